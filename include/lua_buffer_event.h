@@ -1,15 +1,44 @@
 
 #ifndef LUA_BUFFER_EVENT_H
 #define LUA_BUFFER_EVENT_H
- 
+
 #include "lua_event.h"
 
-typedef struct {
+typedef struct lua_BufferEvent {
 	struct bufferevent* bev;
 	lua_Event* event;
+	int ev_ref;
+	/* Position in the base's activity list */
+	struct lua_BufferEvent* lru_prev;
+	struct lua_BufferEvent* lru_next;
+	/* Connection pool state, see lua_buffer_event_pool.c */
+	int pooled;
+	int broken;
+	struct timeval pooled_at;
+	/* Write coalescing state, see luabufferevent_cork */
+	int corked;
+	struct event* flush_ev;
+	struct evbuffer_cb_entry* cork_cb;
+	/* Bytes held in the input and output buffers */
+	size_t buffered;
+	int read_paused;
+	/* Drain read mode, see luabufferevent_setreadmode */
+	int drain_size;
+	size_t drain_limit;
+	size_t read_high;
+	int rate_limited;
+	/* Owned by a filter on top of it, see luabufferevent_wrap */
+	int wrapped;
 } lua_BufferEvent;
 
 int luabufferevent_register(lua_State* L);
+lua_BufferEvent* luabufferevent_get(lua_State* L, int idx);
 lua_BufferEvent* luabufferevent_check(lua_State* L, int idx);
+void luabufferevent_resetcb(lua_BufferEvent* ev);
+void luabufferevent_close(lua_State* L, int idx);
+lua_BufferEvent* luabufferevent_wrap(lua_State* L, int idx, struct bufferevent* filtered);
+int luabufferevent_setreaper(lua_State* L);
+int luabufferevent_setmemorylimits(lua_State* L);
+int luabufferevent_getbasememory(lua_State* L);
 
 #endif
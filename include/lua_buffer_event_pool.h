@@ -0,0 +1,19 @@
+
+#ifndef LUA_BUFFER_EVENT_POOL_H
+#define LUA_BUFFER_EVENT_POOL_H
+
+#include "lua_buffer_event.h"
+
+typedef struct {
+	lua_Event* event;
+	int max_idle;
+	double idle_timeout;
+	/* Limit of live connections per key, 0 for none */
+	int max_live;
+	/* Table of weak sets of live connections by key */
+	int live_ref;
+} lua_BufferEventPool;
+
+int luabuffereventpool_register(lua_State* L);
+
+#endif
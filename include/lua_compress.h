@@ -0,0 +1,9 @@
+
+#ifndef LUA_COMPRESS_H
+#define LUA_COMPRESS_H
+
+#include "lua_event.h"
+
+int luacompress_register(lua_State* L);
+
+#endif
@@ -12,14 +12,42 @@
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 
+struct lua_BufferEvent;
+struct lua_Watchdog;
+
 typedef struct {
 	struct event_base* base;
 	lua_State* running;
+	/* Bufferevents of this base, least recently active first */
+	struct lua_BufferEvent* lru_head;
+	struct lua_BufferEvent* lru_tail;
+	int bufferevent_count;
+	/* Idle reaper settings, see luabufferevent_setreaper */
+	int reap_max_count;
+	size_t reap_max_memory;
+	int reap_batch;
+	int reaping;
+	struct event* reap_ev;
+	/* Buffered memory accounting, see luabufferevent_setmemorylimits */
+	size_t buffered;
+	size_t mem_soft;
+	size_t mem_hard;
+	int pressure_level;
+	int pressure_ref;
+	int reads_paused;
+	struct event* pressure_ev;
+	/* Callback watchdog, see luawatchdog_set */
+	struct lua_Watchdog* watchdog;
+	/* Recycled buffers and bufferevent shells, see luaevent_getpool */
+	int buffer_pool_ref;
+	int shell_pool_ref;
+	int pool_max;
 } lua_Event;
 
 lua_Event* luaevent_check(lua_State* L, int idx);
 void luaevent_gettimeval(double time, struct timeval *tv);
 int luaevent_getfd(lua_State* L, int idx);
+void luaevent_getpool(lua_State* L, int* ref);
 
 int luaopen_event_core(lua_State* L);
 
@@ -3,14 +3,34 @@
 #define LUA_EVENT_BUFFER_H
 
 #include "lua_event.h"
+#include <event2/buffer.h>
+
+/* Longest pattern buffer:find remembers its scan progress for */
+#define EVENT_BUFFER_SCAN_MAX 64
 
 typedef struct {
 	struct evbuffer* buffer;
+	int owned;
+	/* Space handed out by buffer:reserve, awaiting buffer:commit */
+	struct evbuffer_iovec reserved;
+	int has_reserved;
+	/* Base whose pool buffer:release returns this buffer to, if any */
+	lua_Event* event;
+	int pooled;
+	/* Incremental search state, see luaeventbuffer_find
+		no match of scan_pattern starts in [scan_from, scan_pos) */
+	struct evbuffer_cb_entry* scan_cb;
+	size_t scan_from;
+	size_t scan_pos;
+	size_t scan_len;
+	char scan_pattern[EVENT_BUFFER_SCAN_MAX];
 } lua_EventBuffer;
 
 int luaeventbuffer_register(lua_State* L);
 int lua_iseventbuffer(lua_State* L, int idx);
 lua_EventBuffer* luaeventbuffer_check(lua_State* L, int idx);
 int luaeventbuffer_push(lua_State* L, struct evbuffer* buffer);
+lua_EventBuffer* luaeventbuffer_pushref(lua_State* L, struct evbuffer* buffer);
+void luaeventbuffer_detach(lua_EventBuffer* buf);
 
 #endif
@@ -0,0 +1,29 @@
+
+#ifndef LUA_EVENT_HTTP_H
+#define LUA_EVENT_HTTP_H
+
+#include "lua_event.h"
+#include "lua_event_buffer.h"
+
+typedef struct {
+	struct evhttp* http;
+	lua_Event* event;
+	/* Reused to send string chunks */
+	struct evbuffer* scratch;
+} lua_EventHttp;
+
+typedef struct {
+	lua_EventHttp* http;
+	int cb_ref;
+} lua_EventHttpRoute;
+
+typedef struct {
+	struct evhttp_request* req;
+	lua_EventHttp* http;
+	lua_EventBuffer* body;
+	int chunked;
+} lua_EventHttpRequest;
+
+int luaeventhttp_register(lua_State* L);
+
+#endif
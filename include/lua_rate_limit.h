@@ -0,0 +1,19 @@
+
+#ifndef LUA_RATE_LIMIT_H
+#define LUA_RATE_LIMIT_H
+
+#include "lua_event.h"
+
+typedef struct {
+	struct ev_token_bucket_cfg* cfg;
+} lua_RateLimit;
+
+typedef struct {
+	struct bufferevent_rate_limit_group* group;
+} lua_RateLimitGroup;
+
+int luaratelimit_register(lua_State* L);
+lua_RateLimit* luaratelimit_check(lua_State* L, int idx);
+lua_RateLimitGroup* luaratelimitgroup_check(lua_State* L, int idx);
+
+#endif
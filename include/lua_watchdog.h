@@ -0,0 +1,48 @@
+
+#ifndef LUA_WATCHDOG_H
+#define LUA_WATCHDOG_H
+
+#include "lua_event.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef struct lua_Watchdog {
+	int budget_ms;
+	int tick_ms;
+	int report_ref;
+	/* Shared with the helper thread */
+	/* State running the base's callbacks, the one the hook goes on */
+	lua_State* volatile target;
+	volatile unsigned long generation;
+	volatile int depth;
+	volatile int tripped;
+	volatile unsigned long tripped_generation;
+	volatile int elapsed_ms;
+	volatile int stop;
+	/* Set by the hook, consumed by the callback dispatchers */
+	int aborted;
+	int violations;
+	char last[LUA_IDSIZE + 16];
+	/* Debug hook in place before the watchdog, restored after a trip */
+	lua_Hook saved_hook;
+	int saved_mask;
+	int saved_count;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+} lua_Watchdog;
+
+void luawatchdog_enter(lua_Event* event);
+void luawatchdog_leave(lua_Event* event);
+int luawatchdog_aborted(lua_Event* event);
+void luawatchdog_stop(lua_State* L, lua_Event* event);
+int luawatchdog_set(lua_State* L);
+int luawatchdog_get(lua_State* L);
+
+#endif
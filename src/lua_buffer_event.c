@@ -1,19 +1,49 @@
 
 #include <stdlib.h>
+#include <errno.h>
 #include <lauxlib.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include <event2/buffer.h>
 
 #include "lua_buffer_event.h"
 #include "lua_event_buffer.h"
+#include "lua_rate_limit.h"
 #include "lua_week.h"
+#include "lua_watchdog.h"
 
 #define BUFFER_EVENT_TYPE "*event.core.bufferevent"
 
 /* Locations of READ/WRITE buffers in the fenv */
 #define READ_BUFFER_LOCATION 4
 #define WRITE_BUFFER_LOCATION 5
+/* Locations of the rate limit objects in use, keeping them alive */
+#define RATE_LIMIT_LOCATION 6
+#define RATE_LIMIT_GROUP_LOCATION 7
+/* Location of the bufferevent underneath a filter */
+#define UNDERLYING_LOCATION 8
+
+/* Cork modes */
+#define CORK_NONE 0
+#define CORK_COALESCE 1
+#define CORK_TCP 2
+
+/* Rate limits in effect, drain reads would bypass them */
+#define RATE_LIMIT_OWN 1
+#define RATE_LIMIT_GROUP 2
+
+#ifdef _WIN32
+#define READ_RETRIABLE(e) ((e) == WSAEWOULDBLOCK || (e) == WSAEINTR)
+#else
+#define READ_RETRIABLE(e) ((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == EINTR)
+#endif
+#define WRITE_RETRIABLE(e) READ_RETRIABLE(e)
 
 /* Obtains an lua_BufferEvent structure from a given index */
-static lua_BufferEvent* luabufferevent_get(lua_State* L, int idx) {
+lua_BufferEvent* luabufferevent_get(lua_State* L, int idx) {
 	return (lua_BufferEvent*)luaL_checkudata(L, idx, BUFFER_EVENT_TYPE);
 }
 
@@ -24,12 +54,28 @@ lua_BufferEvent* luabufferevent_check(lua_State* L, int idx) {
 	lua_BufferEvent* ev = (lua_BufferEvent*)luaL_checkudata(L, idx, BUFFER_EVENT_TYPE);
 	if(!ev->bev)
 		luaL_argerror(L, idx, "Attempt to use closed buffer_event object");
+	if(ev->wrapped)
+		luaL_argerror(L, idx, "Attempt to use wrapped buffer_event object");
 	return ev;
 }
 
-static void handle_callback(lua_BufferEvent* ev, short what, int callbackIndex) {
-	lua_State* L = ev->event->running;
-	luaweek_get(L, ev);
+/* Pushes the object of 'ev' through its weak reference
+	Returns 0 and pushes nothing if it is being collected: Lua clears
+	the weak entry before __gc runs and the slot may then be reused by
+	another object
+*/
+static int luabufferevent_pushself(lua_State* L, lua_BufferEvent* ev) {
+	luaweek_get(L, ev->ev_ref);
+	if(lua_touserdata(L, -1) != ev) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	return 1;
+}
+
+static void luabufferevent_call(lua_State* L, lua_BufferEvent* ev, short what, int callbackIndex) {
+	if(!luabufferevent_pushself(L, ev))
+		return;
 	lua_getfenv(L, -1);
 	lua_rawgeti(L, -1, callbackIndex);
 	lua_remove(L, -2);
@@ -38,86 +84,614 @@ static void handle_callback(lua_BufferEvent* ev, short what, int callbackIndex)
 	/* func, bufferevent */
 	lua_pushinteger(L, what);
 	/* What to do w/ errors...? */
-	if(!lua_pcall(L, 2, 0, 0))
+	luawatchdog_enter(ev->event);
+	if(lua_pcall(L, 2, 0, 0))
 	{
 		/* FIXME: Perhaps luaevent users should be
 		 * able to set an error handler? */
 		lua_pop(L, 1); /* Pop error message */
+		luawatchdog_aborted(ev->event);
+	}
+	luawatchdog_leave(ev->event);
+}
+
+static void handle_callback(lua_BufferEvent* ev, short what, int callbackIndex) {
+	luabufferevent_call(ev->event->running, ev, what, callbackIndex);
+}
+
+/* Activity list, kept per base in least recently active order */
+static int luabufferevent_islinked(lua_BufferEvent* ev) {
+	return ev->lru_prev || ev->event->lru_head == ev;
+}
+
+static void luabufferevent_link(lua_BufferEvent* ev) {
+	lua_Event* event = ev->event;
+	ev->lru_prev = event->lru_tail;
+	ev->lru_next = NULL;
+	if(event->lru_tail)
+		event->lru_tail->lru_next = ev;
+	else
+		event->lru_head = ev;
+	event->lru_tail = ev;
+	event->bufferevent_count++;
+}
+
+static void luabufferevent_unlink(lua_BufferEvent* ev) {
+	lua_Event* event = ev->event;
+	if(!luabufferevent_islinked(ev))
+		return;
+	if(ev->lru_prev)
+		ev->lru_prev->lru_next = ev->lru_next;
+	else
+		event->lru_head = ev->lru_next;
+	if(ev->lru_next)
+		ev->lru_next->lru_prev = ev->lru_prev;
+	else
+		event->lru_tail = ev->lru_prev;
+	ev->lru_prev = ev->lru_next = NULL;
+	event->bufferevent_count--;
+}
+
+static void luabufferevent_touch(lua_BufferEvent* ev) {
+	if(ev->event->lru_tail != ev && luabufferevent_islinked(ev)) {
+		luabufferevent_unlink(ev);
+		luabufferevent_link(ev);
+	}
+}
+
+/* Keeps reading after libevent's single read until the socket would
+	block, the read high watermark or the per wakeup limit is reached
+	libevent freezes the end of the input while the read callback runs,
+	it is thawed for the extra reads only
+	Returns BEV_EVENT_EOF or BEV_EVENT_ERROR if the socket ended, 0 otherwise
+*/
+static short luabufferevent_readall(lua_BufferEvent* ev) {
+	evutil_socket_t fd = bufferevent_getfd(ev->bev);
+	struct evbuffer* input = bufferevent_get_input(ev->bev);
+	size_t total = 0;
+	short what = 0;
+	/* Filters report the fd underneath them on libevent 2.1 */
+	if(fd < 0 || ev->rate_limited || bufferevent_get_underlying(ev->bev))
+		return 0;
+	evbuffer_unfreeze(input, 0);
+	for(;;) {
+		int n;
+		if(ev->read_high && evbuffer_get_length(input) >= ev->read_high)
+			break;
+		if(ev->drain_limit && total >= ev->drain_limit)
+			break;
+		if(!(bufferevent_get_enabled(ev->bev) & EV_READ))
+			break;
+		EVUTIL_SET_SOCKET_ERROR(0);
+		n = evbuffer_read(input, fd, ev->drain_size);
+		if(n > 0) {
+			total += n;
+		} else if(n == 0) {
+			what = BEV_EVENT_EOF;
+			break;
+		} else {
+			/* -1 without a socket error comes from the buffer, stop there */
+			int err = EVUTIL_SOCKET_ERROR();
+			if(err && !READ_RETRIABLE(err))
+				what = BEV_EVENT_ERROR;
+			break;
+		}
+	}
+	evbuffer_freeze(input, 0);
+	return what;
+}
+
+static void luabufferevent_readcb(struct bufferevent *bev, void *ptr) {
+	lua_BufferEvent* ev = ptr;
+	short what = 0;
+	luabufferevent_touch(ev);
+	if(ev->drain_size)
+		what = luabufferevent_readall(ev);
+	handle_callback(ev, BEV_EVENT_READING, 1);
+	/* Report the end of the socket after the data read before it */
+	if(what && ev->bev) {
+		bufferevent_disable(ev->bev, EV_READ);
+		handle_callback(ev, BEV_EVENT_READING | what, 3);
+	}
+}
+
+/* Toggles TCP_CORK where the platform has it, otherwise a no-op */
+static void luabufferevent_settcpcork(lua_BufferEvent* ev, int on) {
+#ifdef TCP_CORK
+	evutil_socket_t fd = bufferevent_getfd(ev->bev);
+	if(fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+/* Output has been fully written while corked,
+	hold further writes until the next flush */
+static void luabufferevent_recork(lua_BufferEvent* ev) {
+	bufferevent_disable(ev->bev, EV_WRITE);
+	if(ev->corked == CORK_TCP) {
+		/* Pushes out the trailing partial frame */
+		luabufferevent_settcpcork(ev, 0);
+		luabufferevent_settcpcork(ev, 1);
 	}
 }
 
-static void luabufferevent_readcb(struct bufferevent *ev, void *ptr) {
-	handle_callback((lua_BufferEvent*)ptr, BEV_EVENT_READING, 1);
+/* Runs once per loop iteration after the first write to a corked output */
+static void luabufferevent_flushcb(evutil_socket_t fd, short what, void* ptr) {
+	lua_BufferEvent* ev = ptr;
+	if(ev->bev && ev->corked)
+		bufferevent_enable(ev->bev, EV_WRITE);
 }
 
-static void luabufferevent_writecb(struct bufferevent *ev, void *ptr) {
-	handle_callback((lua_BufferEvent*)ptr, BEV_EVENT_WRITING, 2);
+static void luabufferevent_corkcb(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* ptr) {
+	lua_BufferEvent* ev = ptr;
+	if(info->n_added && !event_pending(ev->flush_ev, EV_TIMEOUT, NULL))
+		event_active(ev->flush_ev, EV_TIMEOUT, 1);
+}
+
+static void luabufferevent_writecb(struct bufferevent *bev, void *ptr) {
+	lua_BufferEvent* ev = ptr;
+	luabufferevent_touch(ev);
+	if(ev->corked && evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		luabufferevent_recork(ev);
+	handle_callback(ev, BEV_EVENT_WRITING, 2);
 }
 
 static void luabufferevent_errorcb(struct bufferevent *ev, short what, void *ptr) {
 	handle_callback((lua_BufferEvent*)ptr, what, 3);
 }
 
+/* Closes up to 'count' of the least recently active bufferevents,
+	never the most recent one
+	The error callback is told about it with BEV_EVENT_TIMEOUT first
+	Returns number of reaped bufferevents
+*/
+static int luabufferevent_reap(lua_State* L, lua_Event* event, int count) {
+	int reaped = 0;
+	if(event->reaping)
+		return 0;
+	event->reaping = 1;
+	while(reaped < count && event->lru_head != event->lru_tail) {
+		lua_BufferEvent* ev = event->lru_head;
+		if(!luabufferevent_pushself(L, ev)) {
+			/* Being collected already */
+			luabufferevent_unlink(ev);
+			continue;
+		}
+		luabufferevent_call(L, ev, BEV_EVENT_READING | BEV_EVENT_TIMEOUT, 3);
+		luabufferevent_close(L, lua_gettop(L));
+		lua_pop(L, 1);
+		reaped++;
+	}
+	event->reaping = 0;
+	return reaped;
+}
+
+/* Reaps a batch if the base is over one of its ceilings */
+static int luabufferevent_reapcheck(lua_State* L, lua_Event* event) {
+	int excess = 0;
+	if(event->reap_max_count && event->bufferevent_count > event->reap_max_count)
+		excess = event->bufferevent_count - event->reap_max_count;
+	if(event->reap_max_memory && !excess && event->buffered > event->reap_max_memory)
+		excess = 1;
+	if(!excess)
+		return 0;
+	if(excess < event->reap_batch)
+		excess = event->reap_batch;
+	return luabufferevent_reap(L, event, excess);
+}
+
+static void luabufferevent_reapcb(evutil_socket_t fd, short what, void* ptr) {
+	lua_Event* event = ptr;
+	if(event->running)
+		luabufferevent_reapcheck(event->running, event);
+}
+
+/* LUA: base:setreaper(maxCount, maxMemory, batch, interval)
+	Closes the least recently active bufferevents in batches of 'batch'
+	(default 64) once the base holds more than 'maxCount' of them or
+	their buffers hold more than 'maxMemory' bytes
+	Ceilings are checked every 'interval' seconds (default 1), the
+	count is also checked whenever a bufferevent is created
+	0 disables a ceiling
+*/
+int luabufferevent_setreaper(lua_State* L) {
+	lua_Event* event = luaevent_check(L, 1);
+	double interval;
+	event->reap_max_count = luaL_optint(L, 2, 0);
+	event->reap_max_memory = (size_t)luaL_optnumber(L, 3, 0);
+	event->reap_batch = luaL_optint(L, 4, 64);
+	interval = luaL_optnumber(L, 5, 1);
+	if(event->reap_ev)
+		event_del(event->reap_ev);
+	if((event->reap_max_count || event->reap_max_memory) && interval > 0) {
+		struct timeval tv;
+		if(!event->reap_ev)
+			event->reap_ev = event_new(event->base, -1, EV_PERSIST, luabufferevent_reapcb, event);
+		luaevent_gettimeval(interval, &tv);
+		event_add(event->reap_ev, &tv);
+	}
+	return 0;
+}
+
+/* Buffered memory accounting
+	Every input/output buffer reports its growth and shrinkage, totals
+	are kept per bufferevent and per base
+	Limit enforcement is deferred to an event since the buffers are
+	being modified when the counters change
+*/
+static int luabufferevent_pressurelevel(lua_Event* event) {
+	if(event->mem_hard && event->buffered > event->mem_hard)
+		return 2;
+	if(event->mem_soft && event->buffered > event->mem_soft)
+		return 1;
+	return 0;
+}
+
+static void luabufferevent_accountcb(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* ptr) {
+	lua_BufferEvent* ev = ptr;
+	lua_Event* event = ev->event;
+	ev->buffered += info->n_added;
+	ev->buffered -= info->n_deleted;
+	event->buffered += info->n_added;
+	event->buffered -= info->n_deleted;
+	if(event->pressure_ev && luabufferevent_pressurelevel(event) != event->pressure_level
+			&& !event_pending(event->pressure_ev, EV_TIMEOUT, NULL))
+		event_active(event->pressure_ev, EV_TIMEOUT, 1);
+}
+
+/* Pauses or resumes reading on every bufferevent of the base,
+	only resuming the ones it paused itself
+*/
+static void luabufferevent_setreadpaused(lua_Event* event, int paused) {
+	lua_BufferEvent* ev;
+	for(ev = event->lru_head; ev; ev = ev->lru_next) {
+		if(paused && (bufferevent_get_enabled(ev->bev) & EV_READ)) {
+			bufferevent_disable(ev->bev, EV_READ);
+			ev->read_paused = 1;
+		} else if(!paused && ev->read_paused) {
+			ev->read_paused = 0;
+			bufferevent_enable(ev->bev, EV_READ);
+		}
+	}
+	event->reads_paused = paused;
+}
+
+/* Closes the bufferevents holding the most memory until the base is
+	back under its hard limit
+	The error callback is told about it with BEV_EVENT_ERROR first
+*/
+static void luabufferevent_shed(lua_State* L, lua_Event* event) {
+	while(event->buffered > event->mem_hard) {
+		lua_BufferEvent *ev, *biggest = NULL;
+		for(ev = event->lru_head; ev; ev = ev->lru_next) {
+			if(!biggest || ev->buffered > biggest->buffered)
+				biggest = ev;
+		}
+		if(!biggest || !biggest->buffered)
+			break;
+		if(!luabufferevent_pushself(L, biggest)) {
+			/* Being collected, its memory goes away with it */
+			break;
+		}
+		luabufferevent_call(L, biggest, BEV_EVENT_ERROR, 3);
+		luabufferevent_close(L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+}
+
+static void luabufferevent_pressurecb(evutil_socket_t fd, short what, void* ptr) {
+	lua_Event* event = ptr;
+	lua_State* L = event->running;
+	int level;
+	if(!L)
+		return;
+	level = luabufferevent_pressurelevel(event);
+	if((level > 0) != event->reads_paused)
+		luabufferevent_setreadpaused(event, level > 0);
+	if(level == 2) {
+		luabufferevent_shed(L, event);
+		level = luabufferevent_pressurelevel(event);
+	}
+	if(level == event->pressure_level)
+		return;
+	event->pressure_level = level;
+	if(event->pressure_ref == LUA_NOREF)
+		return;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, event->pressure_ref);
+	lua_pushinteger(L, level);
+	lua_pushnumber(L, event->buffered);
+	if(lua_pcall(L, 2, 0, 0))
+		lua_pop(L, 1); /* Pop error message */
+}
+
+/* LUA: base:setmemorylimits(soft, hard, pressure)
+	Bounds the bytes held in the buffers of the base's bufferevents
+	Above 'soft' reading is paused on all of them until the total
+	drops back, above 'hard' the biggest ones get closed
+	pressure(level, bytes) is called whenever the level changes
+	between 0 (normal), 1 (soft) and 2 (hard)
+	0 disables a limit
+*/
+int luabufferevent_setmemorylimits(lua_State* L) {
+	lua_Event* event = luaevent_check(L, 1);
+	event->mem_soft = (size_t)luaL_optnumber(L, 2, 0);
+	event->mem_hard = (size_t)luaL_optnumber(L, 3, 0);
+	luaL_unref(L, LUA_REGISTRYINDEX, event->pressure_ref);
+	event->pressure_ref = LUA_NOREF;
+	if(!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TFUNCTION);
+		lua_pushvalue(L, 4);
+		event->pressure_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	if(!event->pressure_ev)
+		event->pressure_ev = event_new(event->base, -1, 0, luabufferevent_pressurecb, event);
+	/* Evaluate against the new limits */
+	if(!event_pending(event->pressure_ev, EV_TIMEOUT, NULL))
+		event_active(event->pressure_ev, EV_TIMEOUT, 1);
+	return 0;
+}
+
+/* LUA: base:getmemory()
+	Returns bytes held in the buffers of the base's bufferevents
+	and the current pressure level
+*/
+int luabufferevent_getbasememory(lua_State* L) {
+	lua_Event* event = luaevent_check(L, 1);
+	lua_pushnumber(L, event->buffered);
+	lua_pushinteger(L, event->pressure_level);
+	return 2;
+}
+
+/* Pushes the fenv of a released bufferevent for reuse
+	Returns 0 and pushes nothing if the base has none to spare
+*/
+static int luabufferevent_reuseshell(lua_State* L, lua_Event* event) {
+	int n;
+	if(event->shell_pool_ref == LUA_NOREF)
+		return 0;
+	luaevent_getpool(L, &event->shell_pool_ref);
+	n = lua_objlen(L, -1);
+	if(n == 0) {
+		lua_pop(L, 1);
+		return 0;
+	}
+	lua_rawgeti(L, -1, n);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, n);
+	lua_remove(L, -2);
+	return 1;
+}
+
+/* Pushes a new lua_BufferEvent owning 'bev' on the stack
+	Lua callbacks are taken from the given (absolute) stack indices
+*/
+static lua_BufferEvent* luabufferevent_push(lua_State* L, lua_Event* event, struct bufferevent* bev, int read, int write, int err) {
+	lua_BufferEvent *ev;
+	ev = (lua_BufferEvent*)lua_newuserdata(L, sizeof(lua_BufferEvent));
+	luaL_getmetatable(L, BUFFER_EVENT_TYPE);
+	lua_setmetatable(L, -2);
+	ev->bev = bev;
+	ev->pooled = 0;
+	ev->broken = 0;
+	ev->corked = CORK_NONE;
+	ev->flush_ev = NULL;
+	ev->cork_cb = NULL;
+	ev->buffered = 0;
+	ev->read_paused = 0;
+	ev->drain_size = 0;
+	ev->drain_limit = 0;
+	ev->read_high = 0;
+	ev->rate_limited = 0;
+	ev->wrapped = 0;
+	luabufferevent_resetcb(ev);
+	lua_pushvalue(L, -1);
+	ev->ev_ref = luaweek_ref(L);
+	if(!luabufferevent_reuseshell(L, event))
+		lua_createtable(L, 8, 0);
+	/* Always fresh wrappers, old ones may still be held by stale handlers */
+	luaeventbuffer_pushref(L, bufferevent_get_input(ev->bev));
+	lua_rawseti(L, -2, READ_BUFFER_LOCATION);
+	luaeventbuffer_pushref(L, bufferevent_get_output(ev->bev));
+	lua_rawseti(L, -2, WRITE_BUFFER_LOCATION);
+	lua_pushvalue(L, read);
+	lua_rawseti(L, -2, 1); // Read
+	lua_pushvalue(L, write);
+	lua_rawseti(L, -2, 2); // Write
+	lua_pushvalue(L, err);
+	lua_rawseti(L, -2, 3); // Err
+	lua_setfenv(L, -2);
+	ev->event = event;
+	evbuffer_add_cb(bufferevent_get_input(ev->bev), luabufferevent_accountcb, ev);
+	evbuffer_add_cb(bufferevent_get_output(ev->bev), luabufferevent_accountcb, ev);
+	luabufferevent_link(ev);
+	return ev;
+}
+
 /* LUA: new(fd, read, write, error)
 	Pushes a new bufferevent instance on the stack
 	Accepts: base, fd, read, write, error cb
 	Requires base, fd and error cb
 */
 static int luabufferevent_new(lua_State* L) {
-	lua_BufferEvent *ev;
 	lua_Event* event = luaevent_check(L, 1);
 	/* NOTE: Should probably reference the socket as well... */
 	int fd = luaevent_getfd(L, 2);
 	luaL_checktype(L, 5, LUA_TFUNCTION);
 	if(!lua_isnil(L, 3)) luaL_checktype(L, 3, LUA_TFUNCTION);
 	if(!lua_isnil(L, 4)) luaL_checktype(L, 4, LUA_TFUNCTION);
-	ev = (lua_BufferEvent*)lua_newuserdata(L, sizeof(lua_BufferEvent));
-	luaL_getmetatable(L, BUFFER_EVENT_TYPE);
-	lua_setmetatable(L, -2);
-	ev->bev = bufferevent_new(fd, luabufferevent_readcb, luabufferevent_writecb, luabufferevent_errorcb, ev);
-	lua_createtable(L, 5, 0);
-	lua_pushvalue(L, 3);
-	lua_rawseti(L, -2, 1); // Read
-	lua_pushvalue(L, 4);
-	lua_rawseti(L, -2, 2); // Write
-	lua_pushvalue(L, 5);
-	lua_rawseti(L, -2, 3); // Err
-
-	luaeventbuffer_push(L, bufferevent_get_input(ev->bev));
-	lua_rawseti(L, -2, READ_BUFFER_LOCATION);
-	luaeventbuffer_push(L, bufferevent_get_output(ev->bev));
-	lua_rawseti(L, -2, WRITE_BUFFER_LOCATION);
-	lua_setfenv(L, -2);
-	ev->event = event;
+	luabufferevent_push(L, event, bufferevent_new(fd, NULL, NULL, NULL, NULL), 3, 4, 5);
+	if(event->reap_max_count && event->bufferevent_count > event->reap_max_count)
+		luabufferevent_reapcheck(L, event);
 	return 1;
 }
 
-/* LUA: __gc and bufferevent:close()
-	Releases the bufferevent resources
+/* Replaces the bufferevent at the given index by a new object for
+	'filtered', a filter on top of it
+	The new object takes over the callbacks and keeps the underlying one
+	alive, which leaves the activity list and gets closed along with it
+	Until then the wrapped object can neither be used nor closed
 */
-static int luabufferevent_gc(lua_State* L) {
-	lua_BufferEvent* ev = luabufferevent_get(L, 1);
-	if(ev->bev) {
+lua_BufferEvent* luabufferevent_wrap(lua_State* L, int idx, struct bufferevent* filtered) {
+	lua_BufferEvent* under = luabufferevent_check(L, idx);
+	lua_BufferEvent* ev;
+	int top;
+	lua_getfenv(L, idx);
+	lua_rawgeti(L, -1, 1);
+	lua_rawgeti(L, -2, 2);
+	lua_rawgeti(L, -3, 3);
+	top = lua_gettop(L);
+	ev = luabufferevent_push(L, under->event, filtered, top - 2, top - 1, top);
+	lua_getfenv(L, -1);
+	lua_pushvalue(L, idx);
+	lua_rawseti(L, -2, UNDERLYING_LOCATION);
+	lua_pop(L, 1);
+	luabufferevent_unlink(under);
+	under->wrapped = 1;
+	/* LS: ..., fenv, read, write, err, new */
+	lua_replace(L, top - 3);
+	lua_settop(L, top - 3);
+	return ev;
+}
+
+/* Removes the bufferevent at the given index from its rate limit group */
+static void luabufferevent_leavegroup(lua_State* L, int idx) {
+	lua_BufferEvent* ev = luabufferevent_get(L, idx);
+	lua_getfenv(L, idx);
+	lua_rawgeti(L, -1, RATE_LIMIT_GROUP_LOCATION);
+	if(!lua_isnil(L, -1)) {
+		if(ev->bev)
+			bufferevent_remove_from_rate_limit_group(ev->bev);
+		ev->rate_limited &= ~RATE_LIMIT_GROUP;
+		/* Drop the group's link to its member */
+		lua_getfenv(L, -1);
+		lua_pushvalue(L, idx);
+		lua_pushnil(L);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, RATE_LIMIT_GROUP_LOCATION);
+	}
+	lua_pop(L, 2);
+}
+
+/* Restores the default callbacks which dispatch into the Lua callbacks
+	stored in the fenv
+*/
+void luabufferevent_resetcb(lua_BufferEvent* ev) {
+	bufferevent_setcb(ev->bev, luabufferevent_readcb, luabufferevent_writecb, luabufferevent_errorcb, ev);
+}
+
+/* Releases the bufferevent resources of the object at the given index */
+void luabufferevent_close(lua_State* L, int idx) {
+	lua_BufferEvent* ev = luabufferevent_get(L, idx);
+	/* Only the filter on top may close it, it still uses it */
+	if(ev->bev && !ev->wrapped) {
 		lua_EventBuffer *read, *write;
-		bufferevent_free(ev->bev);
-		ev->bev = NULL;
+		luabufferevent_unlink(ev);
+		luabufferevent_leavegroup(L, idx);
+		evbuffer_remove_cb(bufferevent_get_input(ev->bev), luabufferevent_accountcb, ev);
+		evbuffer_remove_cb(bufferevent_get_output(ev->bev), luabufferevent_accountcb, ev);
+		ev->event->buffered -= ev->buffered;
+		ev->buffered = 0;
+		if(ev->flush_ev) {
+			event_free(ev->flush_ev);
+			ev->flush_ev = NULL;
+		}
 		/* Also clear out the associated input/output event_buffers
-		 * since they would have already been freed.. */
-		lua_getfenv(L, 1);
+		 * since they are about to be freed.. */
+		lua_getfenv(L, idx);
 		lua_rawgeti(L, -1, READ_BUFFER_LOCATION);
 		lua_rawgeti(L, -2, WRITE_BUFFER_LOCATION);
-		read = luaeventbuffer_check(L, -2);
-		write = luaeventbuffer_check(L, -1);
+		/* Not checked, they may have been collected in the same cycle */
+		read = (lua_EventBuffer*)lua_touserdata(L, -2);
+		write = (lua_EventBuffer*)lua_touserdata(L, -1);
 		/* Erase Lua's link to the buffers */
 		lua_pushnil(L);
 		/* LS: ..., fenv, readBuf, writeBuf, nil */
 		lua_rawseti(L, -4, READ_BUFFER_LOCATION);
 		lua_pushnil(L);
 		lua_rawseti(L, -4, WRITE_BUFFER_LOCATION);
-		/* Erase their knowledge of the buffer so that the GC won't try to double-free */
-		read->buffer = NULL;
-		write->buffer = NULL;
+		/* Erase their knowledge of the buffers, detach needs them alive */
+		luaeventbuffer_detach(read);
+		luaeventbuffer_detach(write);
+		lua_pop(L, 3);
+		bufferevent_free(ev->bev);
+		ev->bev = NULL;
+		/* Filters own the bufferevent underneath */
+		lua_getfenv(L, idx);
+		lua_rawgeti(L, -1, UNDERLYING_LOCATION);
+		if(!lua_isnil(L, -1)) {
+			luabufferevent_get(L, -1)->wrapped = 0;
+			luabufferevent_close(L, lua_gettop(L));
+		}
+		lua_pop(L, 2);
 	}
+}
+
+/* LUA: __gc and bufferevent:close()
+	Releases the bufferevent resources
+*/
+static int luabufferevent_gc(lua_State* L) {
+	luabufferevent_close(L, 1);
+	return 0;
+}
+
+static int luabufferevent_closemethod(lua_State* L) {
+	if(luabufferevent_get(L, 1)->wrapped)
+		luaL_argerror(L, 1, "Attempt to close wrapped buffer_event object, close its filter");
+	luabufferevent_close(L, 1);
+	return 0;
+}
+
+/* LUA: bufferevent:release()
+	Closes the bufferevent and keeps its fenv table for the base's
+	next bufferevent, neither the bufferevent nor buffers obtained
+	from it may be used afterwards
+	Returns true if the shell was kept
+*/
+static int luabufferevent_release(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_check(L, 1);
+	lua_Event* event = ev->event;
+	int i, n;
+	luabufferevent_close(L, 1);
+	lua_getfenv(L, 1);
+	luaevent_getpool(L, &event->shell_pool_ref);
+	n = lua_objlen(L, -1);
+	if(n >= event->pool_max) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	/* LS: ..., fenv, pool */
+	for(i = 1; i <= UNDERLYING_LOCATION; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, -3, i);
+	}
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, n + 1);
+	/* The closed object must not reach the recycled fenv anymore */
+	lua_newtable(L);
+	lua_setfenv(L, 1);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* LUA: bufferevent:setcallbacks(read, write, error)
+	Replaces the Lua callbacks, used when handing a pooled
+	connection to a new owner
+	Requires error cb
+*/
+static int luabufferevent_setcallbacks(lua_State* L) {
+	(void)luabufferevent_check(L, 1);
+	luaL_checktype(L, 4, LUA_TFUNCTION);
+	if(!lua_isnil(L, 2)) luaL_checktype(L, 2, LUA_TFUNCTION);
+	if(!lua_isnil(L, 3)) luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, 1); // Read
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, -2, 2); // Write
+	lua_pushvalue(L, 4);
+	lua_rawseti(L, -2, 3); // Err
 	return 0;
 }
 
@@ -144,6 +718,7 @@ static int luabufferevent_setreadwatermarks(lua_State* L) {
 	high = lua_tonumber(L, 3);
 
 	bufferevent_setwatermark(ev->bev, EV_READ, low, high);
+	ev->read_high = high;
 	return 0;
 }
 
@@ -159,31 +734,229 @@ static int luabufferevent_setwritewatermarks(lua_State* L) {
 	return 0;
 }
 
+/* Maps a timeout in seconds onto the base's shared common-timeout
+	queue for that duration, so re-arming it on every read stays O(1)
+	Returns NULL (no timeout) for nil or values <= 0
+*/
+static const struct timeval* luabufferevent_gettimeout(lua_State* L, lua_BufferEvent* ev, int idx, struct timeval* tv) {
+	const struct timeval* common;
+	double timeout = lua_tonumber(L, idx);
+	if(timeout <= 0)
+		return NULL;
+	luaevent_gettimeval(timeout, tv);
+	common = event_base_init_common_timeout(bufferevent_get_base(ev->bev), tv);
+	return common ? common : tv;
+}
+
+/* LUA: bufferevent:settimeout(read, write)
+	Sets read/write timeouts in (fractional) seconds, nil or 0 disables
+*/
 static int luabufferevent_settimeout(lua_State* L) {
-	int timeout_read, timeout_write;
+	struct timeval read_tv, write_tv;
 	lua_BufferEvent* ev = luabufferevent_get(L, 1);
 	if(!ev->bev) return 0;
 
-	timeout_read = lua_tointeger(L, 2);
-	timeout_write = lua_tointeger(L, 3);
-
-	bufferevent_settimeout(ev->bev, timeout_read, timeout_write);
+	bufferevent_set_timeouts(ev->bev,
+		luabufferevent_gettimeout(L, ev, 2, &read_tv),
+		luabufferevent_gettimeout(L, ev, 3, &write_tv));
 	return 0;
 }
 
 static int luabufferevent_enable(lua_State* L) {
+	int what;
 	lua_BufferEvent* ev = luabufferevent_get(L, 1);
 	if(!ev->bev) return 0;
 
-	lua_pushinteger(L, bufferevent_enable(ev->bev, luaL_checkinteger(L, 2)));
+	what = luaL_checkinteger(L, 2);
+
+	/* Reading resumes once the base is back under its soft limit */
+	if(ev->event->reads_paused && (what & EV_READ)) {
+		ev->read_paused = 1;
+		what &= ~EV_READ;
+	}
+	lua_pushinteger(L, bufferevent_enable(ev->bev, what));
 	return 1;
 }
 
 static int luabufferevent_disable(lua_State* L) {
+	int what;
 	lua_BufferEvent* ev = luabufferevent_get(L, 1);
 	if(!ev->bev) return 0;
 
-	lua_pushinteger(L, bufferevent_disable(ev->bev, luaL_checkinteger(L, 2)));
+	what = luaL_checkinteger(L, 2);
+	if(what & EV_READ)
+		ev->read_paused = 0;
+	lua_pushinteger(L, bufferevent_disable(ev->bev, what));
+	return 1;
+}
+
+/* LUA: bufferevent:cork([tcp])
+	Holds writes in the output buffer and sends them once per loop
+	iteration, when the first write of the iteration gets flushed
+	If tcp is true, TCP_CORK is also set on platforms that have it
+*/
+static int luabufferevent_cork(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_check(L, 1);
+	struct evbuffer* output = bufferevent_get_output(ev->bev);
+	if(ev->corked)
+		return 0;
+	if(!ev->flush_ev)
+		ev->flush_ev = event_new(bufferevent_get_base(ev->bev), -1, 0, luabufferevent_flushcb, ev);
+	ev->cork_cb = evbuffer_add_cb(output, luabufferevent_corkcb, ev);
+	ev->corked = lua_toboolean(L, 2) ? CORK_TCP : CORK_COALESCE;
+	if(ev->corked == CORK_TCP)
+		luabufferevent_settcpcork(ev, 1);
+	bufferevent_disable(ev->bev, EV_WRITE);
+	if(evbuffer_get_length(output) > 0)
+		event_active(ev->flush_ev, EV_TIMEOUT, 1);
+	return 0;
+}
+
+/* LUA: bufferevent:uncork()
+	Leaves cork mode, pending output is sent right away
+*/
+static int luabufferevent_uncork(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_check(L, 1);
+	if(!ev->corked)
+		return 0;
+	evbuffer_remove_cb_entry(bufferevent_get_output(ev->bev), ev->cork_cb);
+	ev->cork_cb = NULL;
+	if(ev->corked == CORK_TCP)
+		luabufferevent_settcpcork(ev, 0);
+	ev->corked = CORK_NONE;
+	bufferevent_enable(ev->bev, EV_WRITE);
+	return 0;
+}
+
+/* Writes the output of a socket bufferevent straight to the socket
+	until it is empty or would block
+	Returns 1 if something was written, 0 if not, -1 on socket errors,
+	which are left for libevent's write event to report
+*/
+static int luabufferevent_writenow(lua_BufferEvent* ev, evutil_socket_t fd) {
+	struct evbuffer* output = bufferevent_get_output(ev->bev);
+	int written = 0;
+	while(evbuffer_get_length(output) > 0) {
+		int n;
+		EVUTIL_SET_SOCKET_ERROR(0);
+		n = evbuffer_write(output, fd);
+		if(n > 0) {
+			written = 1;
+		} else {
+			int err = EVUTIL_SOCKET_ERROR();
+			if(n < 0 && err && !WRITE_RETRIABLE(err))
+				return -1;
+			break;
+		}
+	}
+	return written;
+}
+
+/* LUA: bufferevent:flush([mode])
+	Sends pending output now instead of at the next writable wakeup
+	Socket bufferevents write it to the socket right away, whatever
+	would block is left to the write event, the write callback does
+	not run for the data sent here
+	Filtering bufferevents get 'mode', one of BEV_NORMAL, BEV_FLUSH
+	(default) or BEV_FINISHED
+	Returns 1 if data was sent, 0 if not, -1 on errors
+*/
+static int luabufferevent_flush(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_check(L, 1);
+	int mode = luaL_optint(L, 2, BEV_FLUSH);
+	evutil_socket_t fd = bufferevent_getfd(ev->bev);
+	struct evbuffer* output = bufferevent_get_output(ev->bev);
+	int ret;
+	/* Rate limits are enforced by libevent's own writes only, filters
+		report the fd underneath them on libevent 2.1 */
+	if(fd >= 0 && !ev->rate_limited && !bufferevent_get_underlying(ev->bev))
+		ret = luabufferevent_writenow(ev, fd);
+	else
+		ret = bufferevent_flush(ev->bev, EV_WRITE, mode);
+	if(ev->corked) {
+		if(evbuffer_get_length(output) > 0 || ret < 0)
+			bufferevent_enable(ev->bev, EV_WRITE);
+		else
+			luabufferevent_recork(ev);
+	}
+	lua_pushinteger(L, ret);
+	return 1;
+}
+
+/* LUA: bufferevent:setratelimit(ratelimit)
+	Limits this bufferevent on its own, nil removes the limit
+*/
+static int luabufferevent_setratelimit(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_check(L, 1);
+	int ret;
+	if(lua_isnoneornil(L, 2)) {
+		ret = bufferevent_set_rate_limit(ev->bev, NULL);
+		ev->rate_limited &= ~RATE_LIMIT_OWN;
+	} else {
+		lua_RateLimit* rl = luaratelimit_check(L, 2);
+		ret = bufferevent_set_rate_limit(ev->bev, rl->cfg);
+		ev->rate_limited |= RATE_LIMIT_OWN;
+	}
+	/* The configuration is not copied, keep it alive while in use */
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, RATE_LIMIT_LOCATION);
+	lua_pushinteger(L, ret);
+	return 1;
+}
+
+/* LUA: bufferevent:setratelimitgroup(group)
+	Moves this bufferevent into a rate limit group, nil leaves it
+*/
+static int luabufferevent_setratelimitgroup(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_check(L, 1);
+	lua_RateLimitGroup* g;
+	int ret;
+	luabufferevent_leavegroup(L, 1);
+	if(lua_isnoneornil(L, 2))
+		return 0;
+	g = luaratelimitgroup_check(L, 2);
+	ret = bufferevent_add_to_rate_limit_group(ev->bev, g->group);
+	if(ret == 0) {
+		ev->rate_limited |= RATE_LIMIT_GROUP;
+		/* Group and member reference each other, see luaratelimitgroup_gc */
+		lua_getfenv(L, 2);
+		lua_pushvalue(L, 1);
+		lua_pushboolean(L, 1);
+		lua_rawset(L, -3);
+		lua_getfenv(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawseti(L, -2, RATE_LIMIT_GROUP_LOCATION);
+		lua_pop(L, 2);
+	}
+	lua_pushinteger(L, ret);
+	return 1;
+}
+
+/* LUA: bufferevent:setreadmode(size, limit)
+	Drain mode for bulk transfers: after each wakeup the socket is read
+	in 'size' byte steps until it would block, then the read callback
+	runs once for everything that arrived
+	'limit' caps the bytes read per wakeup (default 0, no cap), the
+	read high watermark and paused reading are respected
+	Rate limited bufferevents keep reading once per wakeup
+	nil or 0 restores the default mode
+*/
+static int luabufferevent_setreadmode(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_check(L, 1);
+	int size = luaL_optint(L, 2, 0);
+	luaL_argcheck(L, size >= 0, 2, "Read size must not be negative");
+	ev->drain_size = size;
+	ev->drain_limit = (size_t)luaL_optnumber(L, 3, 0);
+	return 0;
+}
+
+/* LUA: bufferevent:getmemory()
+	Returns bytes held in the input and output buffers
+*/
+static int luabufferevent_getmemory(lua_State* L) {
+	lua_BufferEvent* ev = luabufferevent_get(L, 1);
+	lua_pushnumber(L, ev->buffered);
 	return 1;
 }
 
@@ -195,6 +968,16 @@ static luaL_Reg luabufferevent_funcs[] = {
 	{"settimeout", luabufferevent_settimeout},
 	{"enable", luabufferevent_enable},
 	{"disable", luabufferevent_disable},
+	{"setcallbacks", luabufferevent_setcallbacks},
+	{"close", luabufferevent_closemethod},
+	{"release", luabufferevent_release},
+	{"cork", luabufferevent_cork},
+	{"uncork", luabufferevent_uncork},
+	{"flush", luabufferevent_flush},
+	{"getmemory", luabufferevent_getmemory},
+	{"setratelimit", luabufferevent_setratelimit},
+	{"setratelimitgroup", luabufferevent_setratelimitgroup},
+	{"setreadmode", luabufferevent_setreadmode},
 	{NULL, NULL}
 };
 
@@ -0,0 +1,366 @@
+
+#include <lauxlib.h>
+
+#include "lua_buffer_event_pool.h"
+#include "lua_event_buffer.h"
+
+#define BUFFER_EVENT_POOL_TYPE "*event.core.pool"
+
+/* Obtains an lua_BufferEventPool structure from a given index */
+static lua_BufferEventPool* luabuffereventpool_get(lua_State* L, int idx) {
+	return (lua_BufferEventPool*)luaL_checkudata(L, idx, BUFFER_EVENT_POOL_TYPE);
+}
+
+/* Idle connections should stay silent, anything arriving on them
+	means the upstream went away or the protocol is out of sync
+*/
+static void luabuffereventpool_idle_readcb(struct bufferevent *bev, void *ptr) {
+	lua_BufferEvent* ev = ptr;
+	ev->broken = 1;
+	bufferevent_disable(bev, EV_READ | EV_WRITE);
+}
+
+static void luabuffereventpool_idle_errorcb(struct bufferevent *bev, short what, void *ptr) {
+	lua_BufferEvent* ev = ptr;
+	ev->broken = 1;
+	bufferevent_disable(bev, EV_READ | EV_WRITE);
+}
+
+/* Checks if an idle connection may still be handed out */
+static int luabuffereventpool_usable(lua_BufferEventPool* pool, lua_BufferEvent* ev, struct timeval* now) {
+	double idle;
+	if(!ev->bev || ev->broken)
+		return 0;
+	if(pool->idle_timeout <= 0)
+		return 1;
+	idle = (now->tv_sec - ev->pooled_at.tv_sec) + (now->tv_usec - ev->pooled_at.tv_usec) / 1000000.0;
+	return idle < pool->idle_timeout;
+}
+
+/* Pushes the idle list for the key at 'keyIdx', or nil if there is none */
+static void luabuffereventpool_getlist(lua_State* L, int poolIdx, int keyIdx) {
+	lua_getfenv(L, poolIdx);
+	lua_pushvalue(L, keyIdx);
+	lua_rawget(L, -2);
+	lua_remove(L, -2);
+}
+
+/* Pushes the set of live connections for the key at 'keyIdx',
+	weak so that dropped connections get collected, or nil if there is none
+*/
+static void luabuffereventpool_getlive(lua_State* L, lua_BufferEventPool* pool, int keyIdx, int create) {
+	lua_rawgeti(L, LUA_REGISTRYINDEX, pool->live_ref);
+	lua_pushvalue(L, keyIdx);
+	lua_rawget(L, -2);
+	if(lua_isnil(L, -1) && create) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushstring(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, keyIdx);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+}
+
+/* Counts the connections in the set on top of the stack,
+	forgetting those that have been closed
+*/
+static int luabuffereventpool_countlive(lua_State* L) {
+	int set = lua_gettop(L);
+	int count = 0;
+	if(lua_isnil(L, set))
+		return 0;
+	lua_pushnil(L);
+	while(lua_next(L, set)) {
+		lua_pop(L, 1);
+		if(luabufferevent_get(L, -1)->bev) {
+			count++;
+		} else {
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, set);
+		}
+	}
+	return count;
+}
+
+/* Counts the connection at 'idx' as live for the key at 'keyIdx'
+	Returns 0 if the key is at its limit
+*/
+static int luabuffereventpool_track(lua_State* L, lua_BufferEventPool* pool, int keyIdx, int idx) {
+	int ok = 1;
+	if(!pool->max_live)
+		return 1;
+	luabuffereventpool_getlive(L, pool, keyIdx, 1);
+	lua_pushvalue(L, idx);
+	lua_rawget(L, -2);
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		ok = luabuffereventpool_countlive(L) < pool->max_live;
+		if(ok) {
+			lua_pushvalue(L, idx);
+			lua_pushboolean(L, 1);
+			lua_rawset(L, -3);
+		}
+	} else {
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return ok;
+}
+
+/* Closes unusable connections in the list on top of the stack and
+	compacts the survivors, keeping their order
+	Returns number of closed connections
+*/
+static int luabuffereventpool_purge(lua_State* L, lua_BufferEventPool* pool, struct timeval* now) {
+	int list = lua_gettop(L);
+	int n = lua_objlen(L, list);
+	int i, kept = 0;
+	for(i = 1; i <= n; i++) {
+		lua_BufferEvent* ev;
+		lua_rawgeti(L, list, i);
+		ev = luabufferevent_get(L, -1);
+		if(luabuffereventpool_usable(pool, ev, now)) {
+			lua_rawseti(L, list, ++kept);
+		} else {
+			ev->pooled = 0;
+			luabufferevent_close(L, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+	}
+	for(i = kept + 1; i <= n; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, list, i);
+	}
+	return n - kept;
+}
+
+/* LUA: new(base, maxIdle, idleTimeout, maxLive)
+	Pushes a new connection pool on the stack
+	maxIdle limits idle connections kept per key (default 8)
+	idleTimeout in seconds, 0 keeps idle connections forever (default)
+	maxLive limits connections per key, idle and checked out, counting
+	those registered through add() or put(), 0 for no limit (default)
+*/
+static int luabuffereventpool_new(lua_State* L) {
+	lua_BufferEventPool* pool;
+	lua_Event* event = luaevent_check(L, 1);
+	int max_idle = luaL_optint(L, 2, 8);
+	double idle_timeout = luaL_optnumber(L, 3, 0);
+	int max_live = luaL_optint(L, 4, 0);
+	pool = (lua_BufferEventPool*)lua_newuserdata(L, sizeof(lua_BufferEventPool));
+	pool->event = event;
+	pool->max_idle = max_idle;
+	pool->idle_timeout = idle_timeout;
+	pool->max_live = max_live;
+	lua_newtable(L);
+	pool->live_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	luaL_getmetatable(L, BUFFER_EVENT_POOL_TYPE);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	lua_setfenv(L, -2);
+	return 1;
+}
+
+/* Pushes nil, or false if the key at 'keyIdx' is at its limit */
+static int luabuffereventpool_none(lua_State* L, lua_BufferEventPool* pool, int keyIdx) {
+	if(!pool->max_live)
+		return 0;
+	luabuffereventpool_getlive(L, pool, keyIdx, 0);
+	if(luabuffereventpool_countlive(L) >= pool->max_live) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	return 0;
+}
+
+/* LUA: pool:get(key)
+	Returns the most recently returned live connection for 'key'
+	with its default callbacks restored, or nil if there is none
+	and a new one may be made, false if the key is at its limit
+	Dead and expired connections found on the way are closed
+*/
+static int luabuffereventpool_checkout(lua_State* L) {
+	lua_BufferEventPool* pool = luabuffereventpool_get(L, 1);
+	struct timeval now;
+	int list, n;
+	luaL_checkany(L, 2);
+	luabuffereventpool_getlist(L, 1, 2);
+	if(lua_isnil(L, -1))
+		return luabuffereventpool_none(L, pool, 2);
+	list = lua_gettop(L);
+	event_base_gettimeofday_cached(pool->event->base, &now);
+	for(n = lua_objlen(L, list); n > 0; n--) {
+		lua_BufferEvent* ev;
+		lua_rawgeti(L, list, n);
+		lua_pushnil(L);
+		lua_rawseti(L, list, n);
+		ev = luabufferevent_get(L, -1);
+		ev->pooled = 0;
+		if(luabuffereventpool_usable(pool, ev, &now)) {
+			luabufferevent_resetcb(ev);
+			return 1;
+		}
+		luabufferevent_close(L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	return luabuffereventpool_none(L, pool, 2);
+}
+
+/* LUA: pool:add(key, bufferevent)
+	Counts a newly made connection towards the limit of 'key'
+	Returns true, or false if the key is at its limit, the connection
+	is left alone then
+*/
+static int luabuffereventpool_add(lua_State* L) {
+	lua_BufferEventPool* pool = luabuffereventpool_get(L, 1);
+	luaL_checkany(L, 2);
+	(void)luabufferevent_check(L, 3);
+	lua_pushboolean(L, luabuffereventpool_track(L, pool, 2, 3));
+	return 1;
+}
+
+/* LUA: pool:put(key, bufferevent)
+	Returns the connection to the idle list for 'key'
+	Returns true if it was kept, otherwise it gets closed and
+	false is returned (already closed, broken, unread input left
+	or the key is at its idle or live limit)
+	Connections not counted yet through add() are counted now
+*/
+static int luabuffereventpool_checkin(lua_State* L) {
+	lua_BufferEventPool* pool = luabuffereventpool_get(L, 1);
+	lua_BufferEvent* ev;
+	int list, n;
+	luaL_checkany(L, 2);
+	ev = luabufferevent_get(L, 3);
+	if(ev->pooled)
+		luaL_argerror(L, 3, "Connection is already pooled");
+	if(!ev->bev) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	luabuffereventpool_getlist(L, 1, 2);
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_getfenv(L, 1);
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -3);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+	}
+	list = lua_gettop(L);
+	n = lua_objlen(L, list);
+	if(ev->broken || n >= pool->max_idle
+		|| evbuffer_get_length(bufferevent_get_input(ev->bev)) > 0
+		|| !luabuffereventpool_track(L, pool, 2, 3)) {
+		luabufferevent_close(L, 3);
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	ev->pooled = 1;
+	event_base_gettimeofday_cached(pool->event->base, &ev->pooled_at);
+	bufferevent_setcb(ev->bev, luabuffereventpool_idle_readcb, NULL, luabuffereventpool_idle_errorcb, ev);
+	/* Keep reading so that a remote close gets noticed while idle */
+	bufferevent_enable(ev->bev, EV_READ);
+	/* Drop the previous owner's callbacks */
+	lua_getfenv(L, 3);
+	for(n = 1; n <= 3; n++) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, n);
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, list, lua_objlen(L, list) + 1);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* LUA: pool:sweep()
+	Closes dead and expired idle connections of every key
+	Returns number of closed connections
+*/
+static int luabuffereventpool_sweep(lua_State* L) {
+	lua_BufferEventPool* pool = luabuffereventpool_get(L, 1);
+	struct timeval now;
+	int closed = 0;
+	event_base_gettimeofday_cached(pool->event->base, &now);
+	lua_getfenv(L, 1);
+	lua_pushnil(L);
+	while(lua_next(L, -2)) {
+		closed += luabuffereventpool_purge(L, pool, &now);
+		lua_pop(L, 1);
+	}
+	lua_pushinteger(L, closed);
+	return 1;
+}
+
+/* LUA: pool:count([key])
+	Returns number of idle connections for 'key', or for all keys
+	With a key and a live limit, also the number of live connections
+*/
+static int luabuffereventpool_count(lua_State* L) {
+	lua_BufferEventPool* pool = luabuffereventpool_get(L, 1);
+	int count = 0;
+	if(lua_isnoneornil(L, 2)) {
+		lua_getfenv(L, 1);
+		lua_pushnil(L);
+		while(lua_next(L, -2)) {
+			count += lua_objlen(L, -1);
+			lua_pop(L, 1);
+		}
+	} else {
+		luabuffereventpool_getlist(L, 1, 2);
+		if(!lua_isnil(L, -1))
+			count = lua_objlen(L, -1);
+		if(pool->max_live) {
+			int live;
+			luabuffereventpool_getlive(L, pool, 2, 0);
+			live = luabuffereventpool_countlive(L);
+			lua_pushinteger(L, count);
+			lua_pushinteger(L, live);
+			return 2;
+		}
+	}
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+static int luabuffereventpool_gc(lua_State* L) {
+	lua_BufferEventPool* pool = luabuffereventpool_get(L, 1);
+	luaL_unref(L, LUA_REGISTRYINDEX, pool->live_ref);
+	pool->live_ref = LUA_NOREF;
+	return 0;
+}
+
+static luaL_Reg luabuffereventpool_funcs[] = {
+	{"get", luabuffereventpool_checkout},
+	{"put", luabuffereventpool_checkin},
+	{"add", luabuffereventpool_add},
+	{"sweep", luabuffereventpool_sweep},
+	{"count", luabuffereventpool_count},
+	{NULL, NULL}
+};
+
+static luaL_Reg funcs[] = {
+	{"new", luabuffereventpool_new},
+	{NULL, NULL}
+};
+
+int luabuffereventpool_register(lua_State* L) {
+	luaL_newmetatable(L, BUFFER_EVENT_POOL_TYPE);
+	lua_pushcfunction(L, luabuffereventpool_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_register(L, NULL, luabuffereventpool_funcs);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_register(L, "event.core.pool", funcs);
+	return 1;
+}
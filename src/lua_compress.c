@@ -0,0 +1,150 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <lauxlib.h>
+#include <zlib.h>
+#include <event2/buffer.h>
+
+#include "lua_compress.h"
+#include "lua_buffer_event.h"
+
+/* Size of the output space reserved per deflate/inflate step */
+#define COMPRESS_CHUNK_SIZE 4096
+
+/* zlib window bits, +16 selects the gzip wrapper, +32 detects either */
+#define COMPRESS_WINDOW_BITS 15
+#define COMPRESS_GZIP 16
+#define COMPRESS_DETECT 32
+
+typedef struct {
+	z_stream in;
+	z_stream out;
+} lua_Compress;
+
+static void luacompress_free(void* ctx) {
+	lua_Compress* c = ctx;
+	inflateEnd(&c->in);
+	deflateEnd(&c->out);
+	free(c);
+}
+
+/* Streams 'src' through zlib into 'dst' one buffer segment at a time,
+	without linearizing either buffer
+	Deflating syncs the stream whenever the source runs dry so that
+	every write reaches the peer, BEV_FINISHED ends the stream
+	Ended streams are reset, data after them starts a new one
+*/
+static enum bufferevent_filter_result luacompress_process(struct evbuffer* src, struct evbuffer* dst,
+		ev_ssize_t limit, enum bufferevent_flush_mode mode, z_stream* z, int deflating) {
+	ev_ssize_t produced = 0;
+	if(deflating && mode == BEV_NORMAL && evbuffer_get_length(src) == 0)
+		return BEV_NEED_MORE;
+	for(;;) {
+		struct evbuffer_iovec in, out;
+		size_t in_len = 0;
+		int flush = Z_NO_FLUSH;
+		int res;
+		if(evbuffer_peek(src, -1, NULL, &in, 1) > 0)
+			in_len = in.iov_len;
+		if(evbuffer_reserve_space(dst, COMPRESS_CHUNK_SIZE, &out, 1) < 1)
+			return BEV_ERROR;
+		z->next_in = in_len ? (Bytef*)in.iov_base : NULL;
+		z->avail_in = (uInt)in_len;
+		z->next_out = (Bytef*)out.iov_base;
+		z->avail_out = (uInt)out.iov_len;
+		if(deflating && evbuffer_get_length(src) == in_len)
+			flush = mode == BEV_FINISHED ? Z_FINISH : Z_SYNC_FLUSH;
+		res = deflating ? deflate(z, flush) : inflate(z, Z_NO_FLUSH);
+		evbuffer_drain(src, in_len - z->avail_in);
+		out.iov_len -= z->avail_out;
+		produced += out.iov_len;
+		evbuffer_commit_space(dst, &out, 1);
+		if(res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+			return BEV_ERROR;
+		/* A finished stream may be followed by the next one, such as
+			concatenated gzip members or writes after BEV_FINISHED */
+		if(res == Z_STREAM_END) {
+			if((deflating ? deflateReset(z) : inflateReset(z)) != Z_OK)
+				return BEV_ERROR;
+			if(evbuffer_get_length(src) == 0)
+				break;
+			continue;
+		}
+		/* Z_BUF_ERROR: no progress possible until more input arrives */
+		if(res == Z_BUF_ERROR)
+			break;
+		if(evbuffer_get_length(src) == 0 && z->avail_out != 0)
+			break;
+		if(limit >= 0 && produced >= limit)
+			break;
+	}
+	return produced ? BEV_OK : BEV_NEED_MORE;
+}
+
+static enum bufferevent_filter_result luacompress_inputcb(struct evbuffer* src, struct evbuffer* dst,
+		ev_ssize_t limit, enum bufferevent_flush_mode mode, void* ctx) {
+	return luacompress_process(src, dst, limit, mode, &((lua_Compress*)ctx)->in, 0);
+}
+
+static enum bufferevent_filter_result luacompress_outputcb(struct evbuffer* src, struct evbuffer* dst,
+		ev_ssize_t limit, enum bufferevent_flush_mode mode, void* ctx) {
+	return luacompress_process(src, dst, limit, mode, &((lua_Compress*)ctx)->out, 1);
+}
+
+/* LUA: compress(bufferevent, {algo = "deflate"|"gzip", level = n})
+	Pushes a new bufferevent compressing everything written to it and
+	decompressing everything read from it
+	The original bufferevent hands its callbacks over and must not be
+	used anymore, closing the new one closes it as well
+	Decompression accepts either format
+*/
+static int luacompress_compress(lua_State* L) {
+	static const char* const algos[] = { "deflate", "gzip", NULL };
+	lua_BufferEvent* under = luabufferevent_check(L, 1);
+	lua_Compress* c;
+	struct bufferevent* filtered;
+	int algo = 0;
+	int level = Z_DEFAULT_COMPRESSION;
+	if(!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "algo");
+		if(!lua_isnil(L, -1))
+			algo = luaL_checkoption(L, -1, NULL, algos);
+		lua_getfield(L, 2, "level");
+		if(!lua_isnil(L, -1))
+			level = luaL_checkint(L, -1);
+		lua_pop(L, 2);
+	}
+	c = malloc(sizeof(lua_Compress));
+	if(!c)
+		return luaL_error(L, "Failed to allocate compression state");
+	memset(c, 0, sizeof(lua_Compress));
+	if(inflateInit2(&c->in, COMPRESS_WINDOW_BITS + COMPRESS_DETECT) != Z_OK) {
+		free(c);
+		return luaL_error(L, "Failed to initialize decompression");
+	}
+	if(deflateInit2(&c->out, level, Z_DEFLATED, COMPRESS_WINDOW_BITS + (algo == 1 ? COMPRESS_GZIP : 0),
+			8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		inflateEnd(&c->in);
+		free(c);
+		return luaL_error(L, "Failed to initialize compression");
+	}
+	filtered = bufferevent_filter_new(under->bev, luacompress_inputcb, luacompress_outputcb,
+		0, luacompress_free, c);
+	if(!filtered) {
+		luacompress_free(c);
+		return luaL_error(L, "Failed to create compression filter");
+	}
+	luabufferevent_wrap(L, 1, filtered);
+	return 1;
+}
+
+static luaL_Reg funcs[] = {
+	{"compress", luacompress_compress},
+	{NULL, NULL}
+};
+
+int luacompress_register(lua_State* L) {
+	luaL_register(L, "event.core.bufferevent", funcs);
+	return 1;
+}
@@ -5,6 +5,11 @@
 
 #include "lua_event_buffer.h"
 #include "lua_buffer_event.h"
+#include "lua_buffer_event_pool.h"
+#include "lua_rate_limit.h"
+#include "lua_compress.h"
+#include "lua_event_http.h"
+#include "lua_watchdog.h"
 #include "lua_week.h"
 
 #define EVENT_BASE_TYPE "*event.core.base"
@@ -17,6 +22,25 @@ int luaevent_newbase(lua_State* L) {
 	lua_Event *event = (lua_Event*)lua_newuserdata(L, sizeof(lua_Event));
 	event->running = NULL; /* No running loop */
 	event->base = event_init();
+	event->lru_head = NULL;
+	event->lru_tail = NULL;
+	event->bufferevent_count = 0;
+	event->reap_max_count = 0;
+	event->reap_max_memory = 0;
+	event->reap_batch = 0;
+	event->reaping = 0;
+	event->reap_ev = NULL;
+	event->buffered = 0;
+	event->mem_soft = 0;
+	event->mem_hard = 0;
+	event->pressure_level = 0;
+	event->pressure_ref = LUA_NOREF;
+	event->reads_paused = 0;
+	event->pressure_ev = NULL;
+	event->watchdog = NULL;
+	event->buffer_pool_ref = LUA_NOREF;
+	event->shell_pool_ref = LUA_NOREF;
+	event->pool_max = 64;
 	luaL_getmetatable(L, EVENT_BASE_TYPE);
 	lua_setmetatable(L, -2);
 	return 1;
@@ -37,6 +61,21 @@ static int luaevent_getsupportedmethods(lua_State* L) {
 
 static int luaeventbase_gc(lua_State* L) {
 	lua_Event *event = luaevent_check(L, 1);
+	luawatchdog_stop(L, event);
+	if(event->reap_ev) {
+		event_free(event->reap_ev);
+		event->reap_ev = NULL;
+	}
+	if(event->pressure_ev) {
+		event_free(event->pressure_ev);
+		event->pressure_ev = NULL;
+	}
+	luaL_unref(L, LUA_REGISTRYINDEX, event->pressure_ref);
+	event->pressure_ref = LUA_NOREF;
+	luaL_unref(L, LUA_REGISTRYINDEX, event->buffer_pool_ref);
+	event->buffer_pool_ref = LUA_NOREF;
+	luaL_unref(L, LUA_REGISTRYINDEX, event->shell_pool_ref);
+	event->shell_pool_ref = LUA_NOREF;
 	if(event->base) {
 		event_base_free(event->base);
 		event->base = NULL;
@@ -61,6 +100,32 @@ int luaevent_getfd(lua_State* L, int idx) {
 	return fd;
 }
 
+/* Pushes one of the base's recycling pools, a list of objects
+	kept for reuse, creating it on first use
+*/
+void luaevent_getpool(lua_State* L, int* ref) {
+	if(*ref == LUA_NOREF) {
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		*ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		return;
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, *ref);
+}
+
+/* Drops pool entries beyond 'max', the GC takes care of them */
+static void luaevent_trimpool(lua_State* L, int ref, int max) {
+	int n;
+	if(ref == LUA_NOREF)
+		return;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	for(n = lua_objlen(L, -1); n > max && n > 0; n--) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, n);
+	}
+	lua_pop(L, 1);
+}
+
 void luaevent_gettimeval(double time, struct timeval *tv) {
 	tv->tv_sec = (int) time;
 	tv->tv_usec = (int)( (time - tv->tv_sec) * 1000000 );
@@ -119,12 +184,30 @@ static int luaeventbase_getmethod(lua_State* L) {
 	return 1;
 }
 
+/* LUA: base:setbufferpool(max)
+	Limits how many released buffers and bufferevent shells the base
+	keeps for reuse, each (default 64), 0 turns recycling off
+*/
+static int luaeventbase_setbufferpool(lua_State* L) {
+	lua_Event *event = luaevent_check(L, 1);
+	event->pool_max = luaL_checkint(L, 2);
+	luaevent_trimpool(L, event->buffer_pool_ref, event->pool_max);
+	luaevent_trimpool(L, event->shell_pool_ref, event->pool_max);
+	return 0;
+}
+
 static luaL_Reg base_funcs[] = {
 	{ "newevent", luaeventbase_newevent },
 	{ "loop", luaeventbase_loop },
 	{ "loopexit", luaeventbase_loopexit },
 	{ "loopbreak", luaeventbase_loopbreak },
 	{ "getmethod", luaeventbase_getmethod },
+	{ "setreaper", luabufferevent_setreaper },
+	{ "setmemorylimits", luabufferevent_setmemorylimits },
+	{ "getmemory", luabufferevent_getbasememory },
+	{ "setwatchdog", luawatchdog_set },
+	{ "getwatchdog", luawatchdog_get },
+	{ "setbufferpool", luaeventbase_setbufferpool },
 	{ NULL, NULL }
 };
 
@@ -203,6 +286,10 @@ int luaopen_event_core(lua_State* L) {
 	luaeventcallback_register(L);
 	luaeventbuffer_register(L);
 	luabufferevent_register(L);
+	luabuffereventpool_register(L);
+	luaratelimit_register(L);
+	luacompress_register(L);
+	luaeventhttp_register(L);
 	luaweek_register(L);
 	lua_settop(L, 0);
 	/* Setup metatable */
@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <string.h>
 #include <lauxlib.h>
 
 #include "lua_event_buffer.h"
@@ -19,6 +20,8 @@ lua_EventBuffer* luaeventbuffer_check(lua_State* L, int idx) {
 	lua_EventBuffer* buf = (lua_EventBuffer*)luaL_checkudata(L, idx, EVENT_BUFFER_TYPE);
 	if(!buf->buffer)
 		luaL_argerror(L, idx, "Attempt to use closed event_buffer object");
+	if(buf->pooled)
+		luaL_argerror(L, idx, "Attempt to use released event_buffer object");
 	return buf;
 }
 
@@ -37,30 +40,139 @@ int lua_iseventbuffer(lua_State* L, int idx) {
 int luaeventbuffer_push(lua_State* L, struct evbuffer* buffer) {
 	lua_EventBuffer *buf = (lua_EventBuffer*)lua_newuserdata(L, sizeof(lua_EventBuffer));
 	buf->buffer = buffer;
+	buf->owned = 1;
+	buf->has_reserved = 0;
+	buf->event = NULL;
+	buf->pooled = 0;
+	buf->scan_cb = NULL;
+	buf->scan_len = 0;
 	luaL_getmetatable(L, EVENT_BUFFER_TYPE);
 	lua_setmetatable(L, -2);
 	return 1;
 }
 
-/* LUA: new()
+/* Pushes a wrapper for an evbuffer owned by someone else (bufferevent,
+	http request), it never frees the buffer
+	The owner calls luaeventbuffer_detach before the buffer goes away
+*/
+lua_EventBuffer* luaeventbuffer_pushref(lua_State* L, struct evbuffer* buffer) {
+	lua_EventBuffer *buf;
+	luaeventbuffer_push(L, buffer);
+	buf = (lua_EventBuffer*)lua_touserdata(L, -1);
+	buf->owned = 0;
+	return buf;
+}
+
+/* Cuts the wrapper loose from its buffer, further use raises an error
+	The buffer must still be alive, its search callback gets removed
+*/
+void luaeventbuffer_detach(lua_EventBuffer* buf) {
+	if(buf->buffer && buf->scan_cb)
+		evbuffer_remove_cb_entry(buf->buffer, buf->scan_cb);
+	buf->scan_cb = NULL;
+	buf->scan_len = 0;
+	buf->buffer = NULL;
+}
+
+/* Location of the base in the fenv of buffers made with one */
+#define BASE_LOCATION 1
+
+/* LUA: new([base])
 	Pushes a new evbuffer instance on the stack
+	With a base, buffers released to its pool are reused first
+	The buffer keeps the base alive until it is released
 */
 static int luaeventbuffer_new(lua_State* L) {
-	return luaeventbuffer_push(L, evbuffer_new());
+	lua_Event* event;
+	int n;
+	if(lua_isnoneornil(L, 1))
+		return luaeventbuffer_push(L, evbuffer_new());
+	event = luaevent_check(L, 1);
+	luaevent_getpool(L, &event->buffer_pool_ref);
+	n = lua_objlen(L, -1);
+	if(n > 0) {
+		lua_rawgeti(L, -1, n);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, n);
+		((lua_EventBuffer*)lua_touserdata(L, -1))->pooled = 0;
+		lua_getfenv(L, -1);
+	} else {
+		luaeventbuffer_push(L, evbuffer_new());
+		((lua_EventBuffer*)lua_touserdata(L, -1))->event = event;
+		lua_createtable(L, 1, 0);
+		lua_pushvalue(L, -1);
+		lua_setfenv(L, -3);
+	}
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, BASE_LOCATION);
+	lua_pop(L, 1);
+	return 1;
+}
+
+/* LUA: buffer:release()
+	Empties the buffer and returns it to the pool of the base it was
+	created with, the buffer must not be used afterwards
+	Buffers without a base, or beyond the pool limit, are closed
+	Returns true if the buffer was pooled
+*/
+static int luaeventbuffer_release(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_check(L, 1);
+	lua_Event* event = buf->event;
+	int n = 0;
+	/* The base is only gone if collected in the same cycle */
+	if(event && !event->base)
+		event = NULL;
+	if(event && buf->owned) {
+		luaevent_getpool(L, &event->buffer_pool_ref);
+		n = lua_objlen(L, -1);
+	}
+	if(!event || !buf->owned || n >= event->pool_max) {
+		struct evbuffer* buffer = buf->buffer;
+		luaeventbuffer_detach(buf);
+		if(buf->owned)
+			evbuffer_free(buffer);
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	evbuffer_drain(buf->buffer, evbuffer_get_length(buf->buffer));
+	buf->has_reserved = 0;
+	buf->scan_len = 0;
+	buf->pooled = 1;
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, n + 1);
+	/* Pooled buffers must not keep their base, and with it the pool, alive */
+	lua_getfenv(L, 1);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, BASE_LOCATION);
+	lua_pop(L, 1);
+	lua_pushboolean(L, 1);
+	return 1;
 }
 
-/* LUA: __gc and buffer:close()
+/* LUA: __gc
 	Releases the buffer resources
 */
 static int luaeventbuffer_gc(lua_State* L) {
 	lua_EventBuffer* buf = luaeventbuffer_get(L, 1);
 	if(buf->buffer) {
-		evbuffer_free(buf->buffer);
-		buf->buffer = NULL;
+		struct evbuffer* buffer = buf->buffer;
+		luaeventbuffer_detach(buf);
+		if(buf->owned)
+			evbuffer_free(buffer);
 	}
 	return 0;
 }
 
+/* LUA: buffer:close()
+	Releases the buffer resources, released buffers belong to the pool
+*/
+static int luaeventbuffer_close(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_get(L, 1);
+	if(buf->pooled)
+		luaL_argerror(L, 1, "Attempt to use released event_buffer object");
+	return luaeventbuffer_gc(L);
+}
+
 /* LUA: buffer:add(...)
 	progressively adds items to the buffer
 		if arg[*] is string, treat as a string:format call
@@ -226,15 +338,221 @@ static int luaeventbuffer_read(lua_State* L) {
 	lua_pushinteger(L, ret);
 	return 1;
 }
+/* Raw memory access, meant for LuaJIT FFI parsers
+	Pointers are lightuserdata into the buffer's own memory:
+	- pullup() pointers stay valid until the buffer is next modified
+	  (add, drain, consume, read, write, commit) or control returns to
+	  the event loop, which may read into or write out of it
+	- reserve() pointers stay valid until commit(), nothing else may
+	  modify the buffer in between
+*/
+
+/* LUA: buffer:pullup([len])
+	Makes the first 'len' bytes (default all) contiguous
+	Returns pointer and length, len is capped at the buffer length
+*/
+static int luaeventbuffer_pullup(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_check(L, 1);
+	size_t length = evbuffer_get_length(buf->buffer);
+	size_t len = length;
+	if(!lua_isnoneornil(L, 2)) {
+		lua_Integer n = luaL_checkinteger(L, 2);
+		if(n >= 0 && (size_t)n < length)
+			len = n;
+	}
+	lua_pushlightuserdata(L, evbuffer_pullup(buf->buffer, len));
+	lua_pushinteger(L, len);
+	return 2;
+}
+
+/* LUA: buffer:consume(len)
+	Drains 'len' bytes after they have been parsed through pullup()
+	Unlike drain() it rejects lengths outside 0..getlength()
+	Returns the remaining length
+*/
+static int luaeventbuffer_consume(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_check(L, 1);
+	lua_Integer len = luaL_checkinteger(L, 2);
+	size_t length = evbuffer_get_length(buf->buffer);
+	luaL_argcheck(L, len >= 0 && (size_t)len <= length, 2, "Length out of buffer range");
+	evbuffer_drain(buf->buffer, len);
+	lua_pushinteger(L, length - len);
+	return 1;
+}
+
+/* LUA: buffer:reserve(len)
+	Reserves at least 'len' contiguous bytes at the end of the buffer
+	Returns pointer and the reserved length, fill it and call commit()
+*/
+static int luaeventbuffer_reserve(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_check(L, 1);
+	lua_Integer len = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, len > 0, 2, "Length must be positive");
+	if(buf->has_reserved)
+		luaL_error(L, "Space already reserved, commit it first");
+	if(evbuffer_reserve_space(buf->buffer, len, &buf->reserved, 1) < 1)
+		luaL_error(L, "Failed to reserve buffer space");
+	buf->has_reserved = 1;
+	lua_pushlightuserdata(L, buf->reserved.iov_base);
+	lua_pushinteger(L, buf->reserved.iov_len);
+	return 2;
+}
+
+/* LUA: buffer:commit(len)
+	Appends the first 'len' bytes written into the reserved space,
+	0 discards the reservation
+*/
+static int luaeventbuffer_commit(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_check(L, 1);
+	lua_Integer len = luaL_checkinteger(L, 2);
+	if(!buf->has_reserved)
+		luaL_error(L, "No space reserved");
+	luaL_argcheck(L, len >= 0 && (size_t)len <= buf->reserved.iov_len, 2, "Length out of reserved range");
+	buf->reserved.iov_len = len;
+	buf->has_reserved = 0;
+	if(0 != evbuffer_commit_space(buf->buffer, &buf->reserved, 1))
+		luaL_error(L, "Failed to commit buffer space");
+	return 0;
+}
+
+/* Shifts the remembered search offsets along with drained data,
+	evbuffers only lose data at the front
+*/
+static void luaeventbuffer_scancb(struct evbuffer* buffer, const struct evbuffer_cb_info* info, void* arg) {
+	lua_EventBuffer* buf = arg;
+	size_t n = info->n_deleted;
+	if(!n)
+		return;
+	buf->scan_from = buf->scan_from > n ? buf->scan_from - n : 0;
+	buf->scan_pos = buf->scan_pos > n ? buf->scan_pos - n : 0;
+}
+
+/* Returns offset of the first match of 'pattern' starting at 'from'
+	but before 'to' (< 0 for no limit), or -1
+	evbuffer_search walks the chains in place with memchr and memcmp,
+	nothing gets pulled up
+*/
+static ev_ssize_t luaeventbuffer_search(struct evbuffer* buffer, const char* pattern, size_t len, size_t from, ev_ssize_t to) {
+	size_t length = evbuffer_get_length(buffer);
+	struct evbuffer_ptr start, end, found;
+	if(from >= length || len > length - from)
+		return -1;
+	if(evbuffer_ptr_set(buffer, &start, from, EVBUFFER_PTR_SET) < 0)
+		return -1;
+	/* Matches have to end by 'end' to start before 'to' */
+	if(to >= 0 && (size_t)to - 1 + len < length) {
+		if((size_t)to <= from)
+			return -1;
+		evbuffer_ptr_set(buffer, &end, to - 1 + len, EVBUFFER_PTR_SET);
+		found = evbuffer_search_range(buffer, pattern, len, &start, &end);
+	} else {
+		found = evbuffer_search(buffer, pattern, len, &start);
+	}
+	return found.pos;
+}
+
+/* Positions returned by find/findany are 1-based like getdata's:
+	buffer:getdata(pos - 1) is the data before the match and
+	buffer:drain(pos - 1 + #pattern) drops everything up to its end
+*/
+
+/* LUA: buffer:find(pattern, [start])
+	Returns position of the first occurrence of the plain string
+	'pattern' at or after 'start' (default 1), or nil
+	For patterns up to EVENT_BUFFER_SCAN_MAX bytes the buffer remembers
+	how far it got, so polling a growing buffer for the same pattern
+	only scans the new data; draining keeps that progress valid
+*/
+static int luaeventbuffer_find(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_check(L, 1);
+	size_t len, from, length;
+	const char* pattern = luaL_checklstring(L, 2, &len);
+	lua_Integer start = luaL_optinteger(L, 3, 1);
+	ev_ssize_t pos;
+	int cached;
+	luaL_argcheck(L, len > 0, 2, "Empty pattern");
+	from = start > 1 ? (size_t)start - 1 : 0;
+	length = evbuffer_get_length(buf->buffer);
+	if(from >= length)
+		return 0;
+	cached = buf->scan_len == len && 0 == memcmp(buf->scan_pattern, pattern, len)
+		&& from >= buf->scan_from && from <= buf->scan_pos;
+	pos = luaeventbuffer_search(buf->buffer, pattern, len, cached ? buf->scan_pos : from, -1);
+	if(len <= EVENT_BUFFER_SCAN_MAX) {
+		if(!buf->scan_cb)
+			buf->scan_cb = evbuffer_add_cb(buf->buffer, luaeventbuffer_scancb, buf);
+		if(!cached) {
+			memcpy(buf->scan_pattern, pattern, len);
+			buf->scan_len = len;
+			buf->scan_from = from;
+			buf->scan_pos = from;
+		}
+		if(pos >= 0)
+			buf->scan_pos = pos;
+		else if(length >= len && length - len + 1 > buf->scan_pos)
+			buf->scan_pos = length - len + 1;
+	}
+	if(pos < 0)
+		return 0;
+	lua_pushinteger(L, pos + 1);
+	return 1;
+}
+
+/* LUA: buffer:findany(patterns, [start])
+	Searches for several plain strings at once, such as alternative
+	delimiters, at or after 'start' (default 1)
+	Returns position of the earliest match and the index of its pattern
+	in 'patterns', the first listed wins a tie, or nil
+	Each pattern's scan stops at the best match found so far
+*/
+static int luaeventbuffer_findany(lua_State* L) {
+	lua_EventBuffer* buf = luaeventbuffer_check(L, 1);
+	lua_Integer start = luaL_optinteger(L, 3, 1);
+	size_t from = start > 1 ? (size_t)start - 1 : 0;
+	ev_ssize_t best = -1;
+	int i, n, which = 0;
+	luaL_checktype(L, 2, LUA_TTABLE);
+	n = lua_objlen(L, 2);
+	for(i = 1; i <= n; i++) {
+		size_t len;
+		const char* pattern;
+		ev_ssize_t pos;
+		lua_rawgeti(L, 2, i);
+		pattern = lua_tolstring(L, -1, &len);
+		if(!pattern || len == 0)
+			luaL_argerror(L, 2, "Patterns must be non-empty strings");
+		pos = luaeventbuffer_search(buf->buffer, pattern, len, from, best);
+		lua_pop(L, 1);
+		if(pos >= 0) {
+			best = pos;
+			which = i;
+			if((size_t)pos == from)
+				break;
+		}
+	}
+	if(best < 0)
+		return 0;
+	lua_pushinteger(L, best + 1);
+	lua_pushinteger(L, which);
+	return 2;
+}
+
 static luaL_Reg buffer_funcs[] = {
 	{"add", luaeventbuffer_add},
 	{"getlength", luaeventbuffer_get_length},
 	{"getdata", luaeventbuffer_get_data},
 	{"readline", luaeventbuffer_readline},
 	{"drain", luaeventbuffer_drain},
-	{"close", luaeventbuffer_gc},
+	{"close", luaeventbuffer_close},
 	{"read", luaeventbuffer_read},
 	{"write", luaeventbuffer_write},
+	{"pullup", luaeventbuffer_pullup},
+	{"consume", luaeventbuffer_consume},
+	{"reserve", luaeventbuffer_reserve},
+	{"commit", luaeventbuffer_commit},
+	{"release", luaeventbuffer_release},
+	{"find", luaeventbuffer_find},
+	{"findany", luaeventbuffer_findany},
 	{NULL, NULL}
 };
 static luaL_Reg funcs[] = {
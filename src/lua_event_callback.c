@@ -5,6 +5,7 @@
 
 #include "lua_event_callback.h"
 #include "lua_week.h"
+#include "lua_watchdog.h"
 
 #define EVENT_CALLBACK_TYPE "*event.core.eventcallback"
 
@@ -12,6 +13,7 @@
 static void luaeventcallback_handle(int fd, short what, void* p) {
 	lua_EventCallback* cb = p;
 	lua_State* L;
+	int status;
 	if(!cb->event) {
 		/* Callback has been collected... die */
 		/* TODO: What should really be done here... */
@@ -22,7 +24,15 @@ static void luaeventcallback_handle(int fd, short what, void* p) {
 	lua_rawgeti(L, LUA_REGISTRYINDEX, cb->cb_ref);
 	luaweek_get(L, cb->ev_ref);
 	lua_pushinteger(L, what);
-	lua_call(L, 2, 0);
+	luawatchdog_enter(cb->event);
+	status = lua_pcall(L, 2, 0, 0);
+	luawatchdog_leave(cb->event);
+	if(status) {
+		/* Aborted runaway callbacks don't take the loop down */
+		if(!luawatchdog_aborted(cb->event))
+			lua_error(L);
+		lua_pop(L, 1); /* Pop error message */
+	}
 }
 
 static int luaeventcallback_gc(lua_State* L) {
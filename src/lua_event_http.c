@@ -0,0 +1,494 @@
+
+#include <lauxlib.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "lua_event_http.h"
+#include "lua_watchdog.h"
+
+#define EVENT_HTTP_TYPE "*event.core.http"
+#define EVENT_HTTP_ROUTE_TYPE "*event.core.http.route"
+#define EVENT_HTTP_REQUEST_TYPE "*event.core.http.request"
+
+/* Location of the default route in the server's fenv, paths are strings */
+#define DEFAULT_ROUTE_LOCATION 1
+/* Location of the body buffer in the request's fenv */
+#define BODY_BUFFER_LOCATION 1
+
+/* Obtains an lua_EventHttp structure from a given index
+	AND checks that it hadn't been prematurely freed
+*/
+static lua_EventHttp* luaeventhttp_check(lua_State* L, int idx) {
+	lua_EventHttp* http = (lua_EventHttp*)luaL_checkudata(L, idx, EVENT_HTTP_TYPE);
+	if(!http->http)
+		luaL_argerror(L, idx, "Attempt to use closed http object");
+	return http;
+}
+
+/* Obtains an lua_EventHttpRequest structure from a given index
+	AND checks that it hasn't been answered yet
+*/
+static lua_EventHttpRequest* luaeventhttprequest_check(lua_State* L, int idx) {
+	lua_EventHttpRequest* r = (lua_EventHttpRequest*)luaL_checkudata(L, idx, EVENT_HTTP_REQUEST_TYPE);
+	if(!r->req)
+		luaL_argerror(L, idx, "Attempt to use finished http request object");
+	return r;
+}
+
+/* The request is gone after this, it has either been answered or
+	its connection was closed
+*/
+static void luaeventhttprequest_finish(lua_EventHttpRequest* r) {
+	evhttp_connection_set_closecb(evhttp_request_get_connection(r->req), NULL, NULL);
+	r->req = NULL;
+	if(r->body)
+		luaeventbuffer_detach(r->body);
+}
+
+/* The client went away before the reply, evhttp detaches a request
+	still owned by the user from the connection and leaves freeing it
+	to the owner, requests it still holds are freed along with it
+*/
+static void luaeventhttprequest_closecb(struct evhttp_connection* evcon, void* arg) {
+	lua_EventHttpRequest* r = arg;
+	struct evhttp_request* req = r->req;
+	r->req = NULL;
+	if(r->body)
+		luaeventbuffer_detach(r->body);
+	if(req && !evhttp_request_get_connection(req))
+		evhttp_request_free(req);
+}
+
+/* Requests are processed one at a time per connection, even when
+	pipelined, so the connection's close callback tracks the request
+*/
+static lua_EventHttpRequest* luaeventhttprequest_push(lua_State* L, lua_EventHttp* http, struct evhttp_request* req) {
+	lua_EventHttpRequest* r = (lua_EventHttpRequest*)lua_newuserdata(L, sizeof(lua_EventHttpRequest));
+	r->req = req;
+	r->http = http;
+	r->body = NULL;
+	r->chunked = 0;
+	luaL_getmetatable(L, EVENT_HTTP_REQUEST_TYPE);
+	lua_setmetatable(L, -2);
+	lua_createtable(L, 1, 0);
+	lua_setfenv(L, -2);
+	evhttp_connection_set_closecb(evhttp_request_get_connection(req), luaeventhttprequest_closecb, r);
+	return r;
+}
+
+/* Dispatches a request to the Lua handler of the route evhttp matched
+	Requests left unanswered by a failing handler get a 500
+*/
+static void luaeventhttp_handle(struct evhttp_request* req, void* arg) {
+	lua_EventHttpRoute* route = arg;
+	lua_State* L = route->http->event->running;
+	lua_EventHttpRequest* r;
+	int status;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, route->cb_ref);
+	r = luaeventhttprequest_push(L, route->http, req);
+	luawatchdog_enter(route->http->event);
+	status = lua_pcall(L, 1, 0, 0);
+	luawatchdog_leave(route->http->event);
+	if(status) {
+		lua_pop(L, 1); /* Pop error message */
+		luawatchdog_aborted(route->http->event);
+		if(r->req && !r->chunked) {
+			struct evhttp_request* failed = r->req;
+			luaeventhttprequest_finish(r);
+			evhttp_send_error(failed, HTTP_INTERNAL, NULL);
+		}
+	}
+}
+
+/* Pushes a new route object for the function at 'func' */
+static lua_EventHttpRoute* luaeventhttproute_push(lua_State* L, lua_EventHttp* http, int func) {
+	lua_EventHttpRoute* route;
+	luaL_checktype(L, func, LUA_TFUNCTION);
+	route = (lua_EventHttpRoute*)lua_newuserdata(L, sizeof(lua_EventHttpRoute));
+	route->http = http;
+	lua_pushvalue(L, func);
+	route->cb_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	luaL_getmetatable(L, EVENT_HTTP_ROUTE_TYPE);
+	lua_setmetatable(L, -2);
+	return route;
+}
+
+static int luaeventhttproute_gc(lua_State* L) {
+	lua_EventHttpRoute* route = (lua_EventHttpRoute*)luaL_checkudata(L, 1, EVENT_HTTP_ROUTE_TYPE);
+	luaL_unref(L, LUA_REGISTRYINDEX, route->cb_ref);
+	route->cb_ref = LUA_NOREF;
+	return 0;
+}
+
+/* LUA: new(base)
+	Pushes a new http server on the stack
+*/
+static int luaeventhttp_new(lua_State* L) {
+	lua_Event* event = luaevent_check(L, 1);
+	lua_EventHttp* http = (lua_EventHttp*)lua_newuserdata(L, sizeof(lua_EventHttp));
+	http->event = event;
+	http->http = evhttp_new(event->base);
+	http->scratch = evbuffer_new();
+	luaL_getmetatable(L, EVENT_HTTP_TYPE);
+	lua_setmetatable(L, -2);
+	/* Routes by path, keeping them alive */
+	lua_newtable(L);
+	lua_setfenv(L, -2);
+	if(!http->http)
+		luaL_error(L, "Failed to create http server");
+	return 1;
+}
+
+/* LUA: __gc and http:close()
+	Releases the server, closing its listeners and connections
+*/
+static int luaeventhttp_gc(lua_State* L) {
+	lua_EventHttp* http = (lua_EventHttp*)luaL_checkudata(L, 1, EVENT_HTTP_TYPE);
+	if(http->http) {
+		evhttp_free(http->http);
+		http->http = NULL;
+	}
+	if(http->scratch) {
+		evbuffer_free(http->scratch);
+		http->scratch = NULL;
+	}
+	return 0;
+}
+
+/* LUA: http:bind(address, port)
+	Starts listening, may be called for several addresses
+*/
+static int luaeventhttp_bind(lua_State* L) {
+	lua_EventHttp* http = luaeventhttp_check(L, 1);
+	const char* address = luaL_checkstring(L, 2);
+	int port = luaL_checkint(L, 3);
+	lua_pushinteger(L, evhttp_bind_socket(http->http, address, port));
+	return 1;
+}
+
+/* LUA: http:route(path, handler)
+	handler(request) is called for requests whose path matches exactly,
+	matching is done by evhttp, nil removes the route
+*/
+static int luaeventhttp_route(lua_State* L) {
+	lua_EventHttp* http = luaeventhttp_check(L, 1);
+	const char* path = luaL_checkstring(L, 2);
+	evhttp_del_cb(http->http, path);
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, 2);
+	if(lua_isnoneornil(L, 3)) {
+		lua_pushnil(L);
+	} else {
+		lua_EventHttpRoute* route = luaeventhttproute_push(L, http, 3);
+		evhttp_set_cb(http->http, path, luaeventhttp_handle, route);
+	}
+	lua_rawset(L, -3);
+	return 0;
+}
+
+/* LUA: http:setdefault(handler)
+	handler(request) is called for requests no route matched,
+	nil restores the default 404
+*/
+static int luaeventhttp_setdefault(lua_State* L) {
+	lua_EventHttp* http = luaeventhttp_check(L, 1);
+	lua_getfenv(L, 1);
+	if(lua_isnoneornil(L, 2)) {
+		evhttp_set_gencb(http->http, NULL, NULL);
+		lua_pushnil(L);
+	} else {
+		lua_EventHttpRoute* route = luaeventhttproute_push(L, http, 2);
+		evhttp_set_gencb(http->http, luaeventhttp_handle, route);
+	}
+	lua_rawseti(L, -2, DEFAULT_ROUTE_LOCATION);
+	return 0;
+}
+
+/* LUA: http:settimeout(seconds)
+	Sets the timeout for idle keep-alive and slow connections
+*/
+static int luaeventhttp_settimeout(lua_State* L) {
+	lua_EventHttp* http = luaeventhttp_check(L, 1);
+	evhttp_set_timeout(http->http, luaL_checkint(L, 2));
+	return 0;
+}
+
+/* LUA: http:setmaxsizes(headers, body)
+	Limits request header and body sizes, nil keeps the current limit
+*/
+static int luaeventhttp_setmaxsizes(lua_State* L) {
+	lua_EventHttp* http = luaeventhttp_check(L, 1);
+	if(!lua_isnoneornil(L, 2))
+		evhttp_set_max_headers_size(http->http, (ev_ssize_t)luaL_checknumber(L, 2));
+	if(!lua_isnoneornil(L, 3))
+		evhttp_set_max_body_size(http->http, (ev_ssize_t)luaL_checknumber(L, 3));
+	return 0;
+}
+
+/* LUA: request:getmethod()
+	Returns the request method as a string
+*/
+static int luaeventhttprequest_getmethod(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	const char* method;
+	switch(evhttp_request_get_command(r->req)) {
+	case EVHTTP_REQ_GET: method = "GET"; break;
+	case EVHTTP_REQ_POST: method = "POST"; break;
+	case EVHTTP_REQ_HEAD: method = "HEAD"; break;
+	case EVHTTP_REQ_PUT: method = "PUT"; break;
+	case EVHTTP_REQ_DELETE: method = "DELETE"; break;
+	case EVHTTP_REQ_OPTIONS: method = "OPTIONS"; break;
+	case EVHTTP_REQ_TRACE: method = "TRACE"; break;
+	case EVHTTP_REQ_CONNECT: method = "CONNECT"; break;
+	case EVHTTP_REQ_PATCH: method = "PATCH"; break;
+	default: method = "UNKNOWN"; break;
+	}
+	lua_pushstring(L, method);
+	return 1;
+}
+
+/* LUA: request:geturi()
+	Returns the raw request uri
+*/
+static int luaeventhttprequest_geturi(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	lua_pushstring(L, evhttp_request_get_uri(r->req));
+	return 1;
+}
+
+/* LUA: request:getpath()
+	Returns path and query of the request uri, the query may be nil
+*/
+static int luaeventhttprequest_getpath(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	const struct evhttp_uri* uri = evhttp_request_get_evhttp_uri(r->req);
+	const char* query = evhttp_uri_get_query(uri);
+	lua_pushstring(L, evhttp_uri_get_path(uri));
+	if(!query)
+		return 1;
+	lua_pushstring(L, query);
+	return 2;
+}
+
+/* LUA: request:getheader(name)
+	Looks up a single request header, nil if it is not present
+*/
+static int luaeventhttprequest_getheader(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	const char* value = evhttp_find_header(evhttp_request_get_input_headers(r->req), luaL_checkstring(L, 2));
+	if(!value)
+		return 0;
+	lua_pushstring(L, value);
+	return 1;
+}
+
+/* LUA: request:getheaders()
+	Returns a table of all request headers, prefer getheader() for
+	single lookups as this builds the table every time
+*/
+static int luaeventhttprequest_getheaders(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	struct evkeyval* header;
+	lua_newtable(L);
+	for(header = evhttp_request_get_input_headers(r->req)->tqh_first; header; header = header->next.tqe_next) {
+		lua_pushstring(L, header->value);
+		lua_setfield(L, -2, header->key);
+	}
+	return 1;
+}
+
+/* LUA: request:getbody()
+	Returns the request body as a buffer, without copying it
+	The buffer is closed once the request is answered
+*/
+static int luaeventhttprequest_getbody(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	lua_getfenv(L, 1);
+	if(!r->body) {
+		r->body = luaeventbuffer_pushref(L, evhttp_request_get_input_buffer(r->req));
+		lua_rawseti(L, -2, BODY_BUFFER_LOCATION);
+	}
+	lua_rawgeti(L, -1, BODY_BUFFER_LOCATION);
+	return 1;
+}
+
+/* LUA: request:addheader(name, value)
+	Adds a response header
+*/
+static int luaeventhttprequest_addheader(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	const char* name = luaL_checkstring(L, 2);
+	const char* value = luaL_checkstring(L, 3);
+	lua_pushinteger(L, evhttp_add_header(evhttp_request_get_output_headers(r->req), name, value));
+	return 1;
+}
+
+/* LUA: request:removeheader(name)
+	Removes a response header
+*/
+static int luaeventhttprequest_removeheader(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	lua_pushinteger(L, evhttp_remove_header(evhttp_request_get_output_headers(r->req), luaL_checkstring(L, 2)));
+	return 1;
+}
+
+/* Moves a string or buffer argument into 'dst' */
+static void luaeventhttp_adddata(lua_State* L, int idx, struct evbuffer* dst) {
+	if(lua_isstring(L, idx)) {
+		size_t len;
+		const char* data = lua_tolstring(L, idx, &len);
+		evbuffer_add(dst, data, len);
+	} else {
+		lua_EventBuffer* buf = luaeventbuffer_check(L, idx);
+		evbuffer_add_buffer(dst, buf->buffer);
+	}
+}
+
+/* LUA: request:reply(code, reason, body)
+	Sends the complete response, body is an optional string or buffer,
+	a buffer's contents are moved rather than copied
+	Keep-alive is handled by evhttp
+*/
+static int luaeventhttprequest_reply(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	struct evhttp_request* req = r->req;
+	int code = luaL_checkint(L, 2);
+	const char* reason = luaL_optstring(L, 3, NULL);
+	if(r->chunked)
+		luaL_error(L, "Chunked reply already started");
+	if(!lua_isnoneornil(L, 4))
+		luaeventhttp_adddata(L, 4, evhttp_request_get_output_buffer(req));
+	luaeventhttprequest_finish(r);
+	evhttp_send_reply(req, code, reason ? reason : "", NULL);
+	return 0;
+}
+
+/* LUA: request:startchunk(code, reason)
+	Starts a chunked response, send data with chunk() and end it with endchunk()
+*/
+static int luaeventhttprequest_startchunk(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	int code = luaL_checkint(L, 2);
+	const char* reason = luaL_optstring(L, 3, "");
+	if(r->chunked)
+		luaL_error(L, "Chunked reply already started");
+	r->chunked = 1;
+	evhttp_send_reply_start(r->req, code, reason);
+	return 0;
+}
+
+/* LUA: request:chunk(data)
+	Sends a string or buffer as the next chunk
+*/
+static int luaeventhttprequest_chunk(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	if(!r->chunked)
+		luaL_error(L, "Chunked reply not started");
+	if(lua_isstring(L, 2)) {
+		luaeventhttp_adddata(L, 2, r->http->scratch);
+		evhttp_send_reply_chunk(r->req, r->http->scratch);
+	} else {
+		lua_EventBuffer* buf = luaeventbuffer_check(L, 2);
+		evhttp_send_reply_chunk(r->req, buf->buffer);
+	}
+	return 0;
+}
+
+/* LUA: request:endchunk()
+	Ends a chunked response
+*/
+static int luaeventhttprequest_endchunk(lua_State* L) {
+	lua_EventHttpRequest* r = luaeventhttprequest_check(L, 1);
+	struct evhttp_request* req = r->req;
+	if(!r->chunked)
+		luaL_error(L, "Chunked reply not started");
+	luaeventhttprequest_finish(r);
+	evhttp_send_reply_end(req);
+	return 0;
+}
+
+/* LUA: request:isopen()
+	Returns true while the request can still be answered
+*/
+static int luaeventhttprequest_isopen(lua_State* L) {
+	lua_EventHttpRequest* r = (lua_EventHttpRequest*)luaL_checkudata(L, 1, EVENT_HTTP_REQUEST_TYPE);
+	lua_pushboolean(L, r->req != NULL);
+	return 1;
+}
+
+/* LUA: __gc
+	A request dropped without an answer is answered with a 500 so that
+	its connection doesn't hang
+*/
+static int luaeventhttprequest_gc(lua_State* L) {
+	lua_EventHttpRequest* r = (lua_EventHttpRequest*)luaL_checkudata(L, 1, EVENT_HTTP_REQUEST_TYPE);
+	if(r->req) {
+		struct evhttp_request* req = r->req;
+		int chunked = r->chunked;
+		luaeventhttprequest_finish(r);
+		if(chunked)
+			evhttp_send_reply_end(req);
+		else
+			evhttp_send_error(req, HTTP_INTERNAL, NULL);
+	}
+	return 0;
+}
+
+static luaL_Reg http_funcs[] = {
+	{"bind", luaeventhttp_bind},
+	{"route", luaeventhttp_route},
+	{"setdefault", luaeventhttp_setdefault},
+	{"settimeout", luaeventhttp_settimeout},
+	{"setmaxsizes", luaeventhttp_setmaxsizes},
+	{"close", luaeventhttp_gc},
+	{NULL, NULL}
+};
+
+static luaL_Reg request_funcs[] = {
+	{"getmethod", luaeventhttprequest_getmethod},
+	{"geturi", luaeventhttprequest_geturi},
+	{"getpath", luaeventhttprequest_getpath},
+	{"getheader", luaeventhttprequest_getheader},
+	{"getheaders", luaeventhttprequest_getheaders},
+	{"getbody", luaeventhttprequest_getbody},
+	{"addheader", luaeventhttprequest_addheader},
+	{"removeheader", luaeventhttprequest_removeheader},
+	{"reply", luaeventhttprequest_reply},
+	{"startchunk", luaeventhttprequest_startchunk},
+	{"chunk", luaeventhttprequest_chunk},
+	{"endchunk", luaeventhttprequest_endchunk},
+	{"isopen", luaeventhttprequest_isopen},
+	{NULL, NULL}
+};
+
+static luaL_Reg funcs[] = {
+	{"new", luaeventhttp_new},
+	{NULL, NULL}
+};
+
+int luaeventhttp_register(lua_State* L) {
+	luaL_newmetatable(L, EVENT_HTTP_TYPE);
+	lua_pushcfunction(L, luaeventhttp_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_register(L, NULL, http_funcs);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, EVENT_HTTP_ROUTE_TYPE);
+	lua_pushcfunction(L, luaeventhttproute_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, EVENT_HTTP_REQUEST_TYPE);
+	lua_pushcfunction(L, luaeventhttprequest_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_register(L, NULL, request_funcs);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_register(L, "event.core.http", funcs);
+	return 1;
+}
@@ -0,0 +1,188 @@
+
+#include <lauxlib.h>
+
+#include "lua_rate_limit.h"
+#include "lua_buffer_event.h"
+
+#define RATE_LIMIT_TYPE "*event.core.ratelimit"
+#define RATE_LIMIT_GROUP_TYPE "*event.core.ratelimitgroup"
+
+/* Obtains an lua_RateLimit structure from a given index */
+lua_RateLimit* luaratelimit_check(lua_State* L, int idx) {
+	return (lua_RateLimit*)luaL_checkudata(L, idx, RATE_LIMIT_TYPE);
+}
+
+/* Obtains an lua_RateLimitGroup structure from a given index
+	AND checks that it hadn't been prematurely freed
+*/
+lua_RateLimitGroup* luaratelimitgroup_check(lua_State* L, int idx) {
+	lua_RateLimitGroup* g = (lua_RateLimitGroup*)luaL_checkudata(L, idx, RATE_LIMIT_GROUP_TYPE);
+	if(!g->group)
+		luaL_argerror(L, idx, "Attempt to use closed rate limit group object");
+	return g;
+}
+
+/* LUA: new(readRate, readBurst, writeRate, writeBurst, tick)
+	Pushes a new token bucket configuration on the stack
+	Rates and bursts are in bytes per tick, tick is in seconds (default 1)
+*/
+static int luaratelimit_new(lua_State* L) {
+	lua_RateLimit* rl;
+	struct timeval tv;
+	size_t read_rate, read_burst, write_rate, write_burst;
+	double tick = luaL_optnumber(L, 5, 1);
+	int i;
+	/* Checked before the cast, negative numbers would wrap around */
+	for(i = 1; i <= 4; i++)
+		luaL_argcheck(L, luaL_checknumber(L, i) >= 1, i, "Rates and bursts must be at least 1 byte");
+	/* libevent divides by the tick in milliseconds */
+	luaL_argcheck(L, tick >= 0.001, 5, "Tick must be at least 1 ms");
+	read_rate = (size_t)lua_tonumber(L, 1);
+	read_burst = (size_t)lua_tonumber(L, 2);
+	write_rate = (size_t)lua_tonumber(L, 3);
+	write_burst = (size_t)lua_tonumber(L, 4);
+	luaevent_gettimeval(tick, &tv);
+	rl = (lua_RateLimit*)lua_newuserdata(L, sizeof(lua_RateLimit));
+	rl->cfg = ev_token_bucket_cfg_new(read_rate, read_burst, write_rate, write_burst, &tv);
+	if(!rl->cfg)
+		luaL_error(L, "Invalid rate limit: rates must not exceed bursts");
+	luaL_getmetatable(L, RATE_LIMIT_TYPE);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int luaratelimit_gc(lua_State* L) {
+	lua_RateLimit* rl = luaratelimit_check(L, 1);
+	if(rl->cfg) {
+		ev_token_bucket_cfg_free(rl->cfg);
+		rl->cfg = NULL;
+	}
+	return 0;
+}
+
+/* LUA: newgroup(base, ratelimit)
+	Pushes a new rate limit group on the stack, the configuration
+	is copied and shared by all members
+*/
+static int luaratelimitgroup_new(lua_State* L) {
+	lua_RateLimitGroup* g;
+	lua_Event* event = luaevent_check(L, 1);
+	lua_RateLimit* rl = luaratelimit_check(L, 2);
+	g = (lua_RateLimitGroup*)lua_newuserdata(L, sizeof(lua_RateLimitGroup));
+	g->group = bufferevent_rate_limit_group_new(event->base, rl->cfg);
+	if(!g->group)
+		luaL_error(L, "Failed to create rate limit group");
+	luaL_getmetatable(L, RATE_LIMIT_GROUP_TYPE);
+	lua_setmetatable(L, -2);
+	/* Members, see bufferevent:setratelimitgroup
+		weak so that dropped bufferevents can still be collected */
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushstring(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfenv(L, -2);
+	return 1;
+}
+
+/* LUA: __gc
+	Members still alive leave the group before it is freed
+*/
+static int luaratelimitgroup_gc(lua_State* L) {
+	lua_RateLimitGroup* g = (lua_RateLimitGroup*)luaL_checkudata(L, 1, RATE_LIMIT_GROUP_TYPE);
+	if(g->group) {
+		lua_getfenv(L, 1);
+		lua_pushnil(L);
+		while(lua_next(L, -2)) {
+			lua_BufferEvent* ev = luabufferevent_get(L, -2);
+			if(ev->bev)
+				bufferevent_remove_from_rate_limit_group(ev->bev);
+			lua_pop(L, 1);
+		}
+		bufferevent_rate_limit_group_free(g->group);
+		g->group = NULL;
+	}
+	return 0;
+}
+
+/* LUA: group:setcfg(ratelimit)
+	Replaces the group's configuration
+*/
+static int luaratelimitgroup_setcfg(lua_State* L) {
+	lua_RateLimitGroup* g = luaratelimitgroup_check(L, 1);
+	lua_RateLimit* rl = luaratelimit_check(L, 2);
+	lua_pushinteger(L, bufferevent_rate_limit_group_set_cfg(g->group, rl->cfg));
+	return 1;
+}
+
+/* LUA: group:setminshare(bytes)
+	Sets the smallest share a member gets per tick
+*/
+static int luaratelimitgroup_setminshare(lua_State* L) {
+	lua_RateLimitGroup* g = luaratelimitgroup_check(L, 1);
+	size_t share = (size_t)luaL_checknumber(L, 2);
+	lua_pushinteger(L, bufferevent_rate_limit_group_set_min_share(g->group, share));
+	return 1;
+}
+
+/* LUA: group:getlimits()
+	Returns bytes currently left in the read and write buckets
+*/
+static int luaratelimitgroup_getlimits(lua_State* L) {
+	lua_RateLimitGroup* g = luaratelimitgroup_check(L, 1);
+	lua_pushnumber(L, bufferevent_rate_limit_group_get_read_limit(g->group));
+	lua_pushnumber(L, bufferevent_rate_limit_group_get_write_limit(g->group));
+	return 2;
+}
+
+/* LUA: group:gettotals()
+	Returns total bytes read and written by members since creation
+	or the last resettotals()
+*/
+static int luaratelimitgroup_gettotals(lua_State* L) {
+	ev_uint64_t read, written;
+	lua_RateLimitGroup* g = luaratelimitgroup_check(L, 1);
+	bufferevent_rate_limit_group_get_totals(g->group, &read, &written);
+	lua_pushnumber(L, (lua_Number)read);
+	lua_pushnumber(L, (lua_Number)written);
+	return 2;
+}
+
+static int luaratelimitgroup_resettotals(lua_State* L) {
+	lua_RateLimitGroup* g = luaratelimitgroup_check(L, 1);
+	bufferevent_rate_limit_group_reset_totals(g->group);
+	return 0;
+}
+
+static luaL_Reg group_funcs[] = {
+	{"setcfg", luaratelimitgroup_setcfg},
+	{"setminshare", luaratelimitgroup_setminshare},
+	{"getlimits", luaratelimitgroup_getlimits},
+	{"gettotals", luaratelimitgroup_gettotals},
+	{"resettotals", luaratelimitgroup_resettotals},
+	{NULL, NULL}
+};
+
+static luaL_Reg funcs[] = {
+	{"new", luaratelimit_new},
+	{"newgroup", luaratelimitgroup_new},
+	{NULL, NULL}
+};
+
+int luaratelimit_register(lua_State* L) {
+	luaL_newmetatable(L, RATE_LIMIT_TYPE);
+	lua_pushcfunction(L, luaratelimit_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, RATE_LIMIT_GROUP_TYPE);
+	lua_pushcfunction(L, luaratelimitgroup_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_newtable(L);
+	luaL_register(L, NULL, group_funcs);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_register(L, "event.core.ratelimit", funcs);
+	return 1;
+}
@@ -0,0 +1,293 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <lauxlib.h>
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#include "lua_watchdog.h"
+
+/* Registry key of the table mapping states to their watchdog */
+static int watchdogs_;
+
+/* Helper thread
+	Callback dispatchers bump the generation on entry and exit, if it
+	stands still while a callback runs for longer than the budget the
+	thread installs a count hook which aborts the callback from within
+	lua_sethook is safe to call asynchronously, nothing else touches
+	the Lua state from this thread
+*/
+static void luawatchdog_hook(lua_State* L, lua_Debug* ar);
+
+static void luawatchdog_sleep(int ms) {
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void luawatchdog_run(lua_Watchdog* w) {
+	unsigned long seen = w->generation;
+	int stalled = 0;
+	while(!w->stop) {
+		luawatchdog_sleep(w->tick_ms);
+		if(w->depth > 0 && w->generation == seen) {
+			stalled += w->tick_ms;
+			if(stalled >= w->budget_ms && !w->tripped) {
+				w->elapsed_ms = stalled;
+				w->tripped_generation = seen;
+				w->tripped = 1;
+				lua_sethook(w->target, luawatchdog_hook, LUA_MASKCOUNT, 1);
+			}
+		} else {
+			seen = w->generation;
+			stalled = 0;
+		}
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI luawatchdog_thread(LPVOID arg) {
+	luawatchdog_run((lua_Watchdog*)arg);
+	return 0;
+}
+#else
+static void* luawatchdog_thread(void* arg) {
+	luawatchdog_run((lua_Watchdog*)arg);
+	return NULL;
+}
+#endif
+
+static lua_Watchdog* luawatchdog_find(lua_State* L) {
+	lua_Watchdog* w;
+	lua_pushlightuserdata(L, &watchdogs_);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+	lua_pushlightuserdata(L, L);
+	lua_rawget(L, -2);
+	w = (lua_Watchdog*)lua_touserdata(L, -1);
+	lua_pop(L, 2);
+	return w;
+}
+
+/* Maps 'key' to the watchdog, or unmaps it when 'w' is NULL */
+static void luawatchdog_map(lua_State* L, lua_State* key, lua_Watchdog* w) {
+	lua_pushlightuserdata(L, &watchdogs_);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlightuserdata(L, &watchdogs_);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	lua_pushlightuserdata(L, key);
+	if(w)
+		lua_pushlightuserdata(L, w);
+	else
+		lua_pushnil(L);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+static void luawatchdog_disarm(lua_Watchdog* w) {
+	w->tripped = 0;
+	lua_sethook(w->target, w->saved_hook, w->saved_mask, w->saved_count);
+}
+
+/* Moves the hook target to 'L', the state now running the callbacks,
+	loop() may be driven from a coroutine
+*/
+static void luawatchdog_retarget(lua_Watchdog* w, lua_State* L) {
+	if(w->tripped)
+		luawatchdog_disarm(w);
+	if(w->target)
+		luawatchdog_map(L, w->target, NULL);
+	w->saved_hook = lua_gethook(L);
+	w->saved_mask = lua_gethookmask(L);
+	w->saved_count = lua_gethookcount(L);
+	w->target = L;
+	luawatchdog_map(L, L, w);
+}
+
+/* Runs in the main thread at the next instruction of the runaway callback */
+static void luawatchdog_hook(lua_State* L, lua_Debug* ar) {
+	lua_Watchdog* w = luawatchdog_find(L);
+	if(!w) {
+		lua_sethook(L, NULL, 0, 0);
+		return;
+	}
+	luawatchdog_disarm(w);
+	/* Stale trip, the callback finished in the meantime */
+	if(w->depth == 0 || w->generation != w->tripped_generation)
+		return;
+	if(lua_getinfo(L, "Sl", ar))
+		snprintf(w->last, sizeof(w->last), "%s:%d", ar->short_src, ar->currentline);
+	w->violations++;
+	w->aborted = 1;
+	if(w->report_ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, w->report_ref);
+		lua_pushstring(L, w->last);
+		lua_pushnumber(L, w->elapsed_ms / 1000.0);
+		if(lua_pcall(L, 2, 0, 0))
+			lua_pop(L, 1); /* Pop error message */
+	}
+	luaL_error(L, "watchdog: callback exceeded its %d ms budget at %s", w->budget_ms, w->last);
+}
+
+void luawatchdog_enter(lua_Event* event) {
+	lua_Watchdog* w = event->watchdog;
+	if(!w) return;
+	if(w->target != event->running)
+		luawatchdog_retarget(w, event->running);
+	/* An abort caught by the callback's own pcall left it set */
+	w->aborted = 0;
+	w->generation++;
+	w->depth++;
+}
+
+/* Counts a callback that overran its budget without the hook ever
+	running, and reports it now that the loop has control again
+*/
+static void luawatchdog_overran(lua_Watchdog* w, lua_State* L) {
+	snprintf(w->last, sizeof(w->last), "?");
+	w->violations++;
+	if(w->report_ref != LUA_NOREF) {
+		lua_rawgeti(L, LUA_REGISTRYINDEX, w->report_ref);
+		lua_pushstring(L, w->last);
+		lua_pushnumber(L, w->elapsed_ms / 1000.0);
+		if(lua_pcall(L, 2, 0, 0))
+			lua_pop(L, 1); /* Pop error message */
+	}
+}
+
+void luawatchdog_leave(lua_Event* event) {
+	lua_Watchdog* w = event->watchdog;
+	int overran;
+	if(!w) return;
+	/* Still armed for this callback: it sat in C code or, under LuaJIT,
+		in compiled traces, neither runs count hooks */
+	overran = w->tripped && w->generation == w->tripped_generation;
+	w->generation++;
+	/* Enabled from within a callback, its entry wasn't counted */
+	if(w->depth > 0)
+		w->depth--;
+	if(w->tripped)
+		luawatchdog_disarm(w);
+	if(overran)
+		luawatchdog_overran(w, event->running);
+}
+
+/* Checks if the last callback error came from the watchdog, which
+	dispatchers swallow instead of passing on
+*/
+int luawatchdog_aborted(lua_Event* event) {
+	lua_Watchdog* w = event->watchdog;
+	int aborted;
+	if(!w) return 0;
+	aborted = w->aborted;
+	w->aborted = 0;
+	return aborted;
+}
+
+/* Stops and frees the base's watchdog, if any */
+void luawatchdog_stop(lua_State* L, lua_Event* event) {
+	lua_Watchdog* w = event->watchdog;
+	if(!w) return;
+	w->stop = 1;
+#ifdef _WIN32
+	WaitForSingleObject(w->thread, INFINITE);
+	CloseHandle(w->thread);
+#else
+	pthread_join(w->thread, NULL);
+#endif
+	if(w->tripped)
+		luawatchdog_disarm(w);
+	if(w->target)
+		luawatchdog_map(L, w->target, NULL);
+	luaL_unref(L, LUA_REGISTRYINDEX, w->report_ref);
+	event->watchdog = NULL;
+	free(w);
+}
+
+/* LUA: base:setwatchdog(budget, report)
+	Aborts Lua callbacks of the base running longer than 'budget'
+	seconds, report(where, elapsed) is called before the abort
+	The budget is enforced by a helper thread with a granularity of a
+	quarter of it, nil turns the watchdog off
+	Watches the state running loop(), which may be a coroutine,
+	coroutines resumed by the callbacks themselves are not interrupted
+	Aborting relies on a count hook, which neither C functions nor
+	LuaJIT's compiled traces run: a hot loop under LuaJIT is not
+	aborted, it is counted and reported with "?" as location once it
+	returns to the loop
+*/
+int luawatchdog_set(lua_State* L) {
+	lua_Event* event = luaevent_check(L, 1);
+	lua_Watchdog* w;
+	int ok;
+	luawatchdog_stop(L, event);
+	if(lua_isnoneornil(L, 2))
+		return 0;
+	w = (lua_Watchdog*)malloc(sizeof(lua_Watchdog));
+	if(!w)
+		return luaL_error(L, "Failed to allocate watchdog");
+	w->target = NULL;
+	w->budget_ms = (int)(luaL_checknumber(L, 2) * 1000);
+	if(w->budget_ms < 1)
+		w->budget_ms = 1;
+	w->tick_ms = w->budget_ms / 4 ? w->budget_ms / 4 : 1;
+	w->report_ref = LUA_NOREF;
+	if(!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TFUNCTION);
+		lua_pushvalue(L, 3);
+		w->report_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	w->generation = 0;
+	w->depth = 0;
+	w->tripped = 0;
+	w->tripped_generation = 0;
+	w->elapsed_ms = 0;
+	w->stop = 0;
+	w->aborted = 0;
+	w->violations = 0;
+	w->last[0] = '\0';
+#ifdef _WIN32
+	w->thread = CreateThread(NULL, 0, luawatchdog_thread, w, 0, NULL);
+	ok = w->thread != NULL;
+#else
+	ok = pthread_create(&w->thread, NULL, luawatchdog_thread, w) == 0;
+#endif
+	if(!ok) {
+		luaL_unref(L, LUA_REGISTRYINDEX, w->report_ref);
+		free(w);
+		return luaL_error(L, "Failed to start watchdog thread");
+	}
+	event->watchdog = w;
+	return 0;
+}
+
+/* LUA: base:getwatchdog()
+	Returns number of aborted callbacks and where the last one was
+*/
+int luawatchdog_get(lua_State* L) {
+	lua_Event* event = luaevent_check(L, 1);
+	lua_Watchdog* w = event->watchdog;
+	if(!w) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	lua_pushinteger(L, w->violations);
+	if(!w->last[0])
+		return 1;
+	lua_pushstring(L, w->last);
+	return 2;
+}